@@ -3,74 +3,3664 @@
 # Script to encode and decode file and folder names
 
 SCRIPT_NAME="$0"
+SCRIPT_PATH=$(readlink -f "$SCRIPT_NAME")
+# perl runs the helpers of sparse files, deltas, tree hashes, --compare and the fast renames
+command -v perl > /dev/null && HAVE_PERL=1 || HAVE_PERL=0
+USAGE="Usage: $0 --encode [--hash] [--upload TARGET] [ROOT...]
+       $0 --encode --to-stream FILE|- [--stream-index] [--volume-size SIZE] [--incremental] [--hash] [ROOT...]
+       $0 --decode [--on-conflict overwrite|skip-identical|keep-newer|rename|fail] [--compare-content]
+       $0 --decode --from-stream FILE|- [--on-conflict POLICY] [PATH...]
+       $0 --upload TARGET [--hash] [--delta] [--compress]
+       $0 --list STREAM...
+       $0 --fetch SOURCE [--on-conflict POLICY] [PATH...]
+       $0 --import-legacy [--strip-root ROOT] [--keep-underscores]
+       $0 --scrub TARGET [--scrub-budget SIZE]
+       $0 --submit [--weight N] OPERATION [OPTION...]
+       $0 --daemon [--slots N]
+       $0 --queue
+       $0 --status [PID|JOB]
+       $0 --compare FOLDER|MANIFEST|SOURCE
+       $0 --gc TARGET [--keep-daily N] [--keep-weekly N] [--keep-monthly N] [--dry-run] [--sweep-foreign]
+Reading options: [--reread-retries N] [--physical-order]
+Upload options: [--jobs N] [--batch N] [--retries N] [--http-field NAME] [--http-form NAME=VALUE]... [--http-chunked]"
 
-# Encode folders by replacing spaces with "§"
-encode_folders() {
-  find . -depth -name "* *" -execdir bash -c 'mv "$1" "${1// /§}"' _ {} \;
+# Stream settings, see parse_options
+STREAM=""           # --to-stream destination, "-" for the standard output
+STREAM_INDEX=0      # End the stream with an index for random access restores
+VOLUME_SIZE=0       # Split the stream into numbered volumes of about this many bytes
+FROM_STREAM=""      # --from-stream source of --decode
+INDEX_NAME=".filinator-index"
+INCREMENTAL=0       # Only stream the files changed since the last --incremental stream
+
+# Fetch settings, see parse_options
+FETCH_SOURCE=""     # Host the files are fetched from, as given to --upload
+CACHE_ROOT=${FILINATOR_CACHE:-${XDG_CACHE_HOME:-$HOME/.cache}/filinator}   # Fetched files, one folder per host
+HASH_CACHE="$CACHE_ROOT/hashes"   # Hashes of the files read before, by device, inode, size, mtime and ctime
+
+# Legacy import settings, see parse_options
+STRIP_ROOT=""          # Folder the former script encoded from, found from the names otherwise
+KEEP_UNDERSCORES=0     # Read an ambiguous "_" as an underscore rather than a space
+
+# Daemon settings, see parse_options
+SPOOL_DIR=${FILINATOR_SPOOL:-${XDG_STATE_HOME:-$HOME/.local/state}/filinator}   # Jobs of --daemon
+SLOTS=2       # Jobs the daemon runs at once
+WEIGHT=1      # Share of the daemon time given to the folder of a submitted job
+
+# Live statistics of every run, read by --status
+STATS_DIR=${FILINATOR_STATS:-/dev/shm/filinator-$UID}   # Memory backed, nothing reaches the disk
+STATS_INTERVAL_MS=1000   # Least time between two updates of the statistics of a run
+STATS_FILE=""
+
+# Scrub settings, see parse_options
+SCRUB_TARGET=""
+SCRUB_BUDGET=1073741824   # Bytes read from the host per run
+SCRUB_RANGE=33554432      # Bytes per range request, large files are read by several jobs
+
+# Garbage collection settings, see parse_options
+GC_TARGET=""
+KEEP_DAILY=7      # Generations kept: the newest of each of the last days,
+KEEP_WEEKLY=4     # weeks
+KEEP_MONTHLY=12   # and months
+DRY_RUN=0         # Only list what would be removed
+SWEEP_FOREIGN=0   # Also remove the files of the host no generation knows and not named like ours
+
+# Decode settings, see parse_options
+ON_CONFLICT="overwrite"   # What to do when a decoded file already exists
+COMPARE_CONTENT=0         # Compare files with the same size and mtime byte for byte
+
+# Upload settings, see parse_options
+UPLOAD_TARGET=""
+JOBS=4
+BATCH=8        # Files sent over one connection before it is recycled
+RETRIES=5      # Extra attempts for a file after a transient failure
+
+# Reading settings
+HASH=0                # Record the sha256 of every file in the manifest
+DELTA=0               # Send only the changed blocks of large files already on the host
+DELTA_BLOCK=1048576   # Block size of the delta signatures
+DELTA_MIN_SIZE=16777216   # Smaller files are always sent whole
+COMPRESS=0            # Send files compressed with zstd, small ones with a dictionary of their extension
+COMPRESS_MAX_SIZE=268435456   # Larger files are sent as they are, rather than staged compressed
+COMPRESS_LEVEL=3      # Level of the first batches, then balanced between compressing and sending
+COMPRESS_MIN_LEVEL=1
+COMPRESS_MAX_LEVEL=19
+COMPRESS_HOPELESS=95  # Extensions compressing to more than this percentage are no longer tried,
+COMPRESS_LEARN_BYTES=1048576   # once this many of their bytes were compressed,
+COMPRESS_PROBE=32     # but for one file in this many
+DICT_MAX_SIZE=32768   # Larger files are compressed without a dictionary
+DICT_MIN_FILES=100    # Small files of an extension needed to train its dictionary
+DICT_SAMPLES=2000     # Files a dictionary is trained on at most
+DICT_SIZE=65536       # Largest dictionary, zstd wants about a hundred times as many sample bytes
+HASH_BATCH=64         # Files per sha256sum run
+TREE_MIN_SIZE=1073741824   # Larger files get a sha256-tree hash, their parts read JOBS at a time
+TREE_CHUNK=67108864        # Leaf size of the sha256-tree hashes, changing it changes the hashes
+REREAD_RETRIES=3      # Extra reads of a file that changed while it was read
+PHYSICAL_ORDER=0      # Read files in the order of their data on the disk, for spinning disks
+PHYSICAL_WINDOW=65536   # Files sorted at a time by --physical-order
+
+# Multipart form used by http:// and https:// targets
+HTTP_FIELD="file"   # Form field carrying the file
+HTTP_FORM=()        # Extra --form-string arguments, such as an API token
+HTTP_CHUNKED=0      # Stream the body with chunked encoding instead of a Content-Length
+
+# Backoff and circuit breaker tuning
+BACKOFF_BASE_MS=500
+BACKOFF_MAX_MS=30000
+BREAKER_THRESHOLD=5      # Overload responses in a row that pause all transfers
+BREAKER_COOLDOWN_MS=10000
+BREAKER_MAX_COOLDOWN_MS=300000
+
+# Behaviour of the mock-sftp:// and mock-http:// upload targets
+MOCK_LATENCY_MS=${FILINATOR_MOCK_LATENCY_MS:-0}            # Round trip time of one request
+MOCK_CONNECT_MS=${FILINATOR_MOCK_CONNECT_MS:-}             # Opening a connection, defaults to a few round trips
+MOCK_BANDWIDTH=${FILINATOR_MOCK_BANDWIDTH:-0}              # Bytes per second per transfer, 0 is unlimited
+MOCK_OVERHEAD_MS=${FILINATOR_MOCK_OVERHEAD_MS:-0}          # Fixed server side cost of every file
+MOCK_MAX_SIZE=${FILINATOR_MOCK_MAX_SIZE:-0}                # Largest accepted file in bytes, 0 is unlimited
+MOCK_CASE_INSENSITIVE=${FILINATOR_MOCK_CASE_INSENSITIVE:-0}  # 1 to fold names like a Windows host
+MOCK_FAILURE_RATE=${FILINATOR_MOCK_FAILURE_RATE:-0}        # Percentage of transfers that fail
+MOCK_SEED=${FILINATOR_MOCK_SEED:-}                         # Makes the failures reproducible
+MOCK_HTTP_SERVER=${FILINATOR_MOCK_HTTP_SERVER:-0}          # 1 to send mock-http:// uploads over real HTTP
+MOCK_HTTP_URL=""
+
+# Bookkeeping kept next to the encoded files; names starting with .filinator- are never encoded
+MANIFEST=".filinator-manifest"
+STAGING=".filinator-staging"
+SCRUB_STATE=".filinator-scrub"   # Scrub cursor: next file and cycle number
+DELTA_STATE=".filinator-delta"   # Block signatures of the files sent with --delta
+DELTA_DIR="."                    # Where restores find the deltas and dictionaries of the host
+DICT_STATE=".filinator-dicts"    # zstd dictionaries of --compress: dict.ID, ext.EXT naming one, sent.ID
+COMPRESS_STATE=".filinator-compressibility"   # Bytes compressed per extension by --compress and what they became
+WALK_STATE=".filinator-walk"     # Folders and files of each root as last streamed with --incremental
+MERKLE=".filinator-merkle"       # Hash of every folder of the manifest, sent along with it
+FOLDER_ID=".filinator-id"        # Random id of the folder, in the names of its generations on the host
+MANIFEST_HEADER=$'# filinator manifest 2\n# name\troot\tpath\tsize\tmtime\textents\thash\tflags'
+MERKLE_HEADER="# filinator merkle 2"
+
+# Scratch space for the encode plan, removed when the script exits
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# Encode a path below a root the same way the former readlink/sed pipeline did:
+# "/" becomes "@", spaces in the root become "_" and "§" becomes a space.
+# The result is stored in ENCODED to avoid a subshell per file.
+encode_name() {
+  local root="$1" rel="$2"
+  [[ "$root" == "/" ]] && root=""
+  root=${root//\//@}
+  root=${root// /_}
+  root=${root//§/ }
+  rel=${rel//\//@}
+  rel=${rel//§/ }
+  ENCODED="$root@$rel"
+}
+
+# Escape backslashes, tabs and newlines for a manifest field, the result is stored in ESCAPED.
+# Fields are read back with printf %b.
+manifest_escape() {
+  ESCAPED=${1//\\/\\\\}
+  ESCAPED=${ESCAPED//$'\t'/\\t}
+  ESCAPED=${ESCAPED//$'\n'/\\n}
+}
+
+# Find the data extents of a sparse file with SEEK_DATA/SEEK_HOLE, stored in EXTENTS
+# as "offset+length,...". A file without any data gets "none".
+data_extents() {
+  (( HAVE_PERL )) || { EXTENTS="-"; return 1; }
+  EXTENTS=$(perl -e '
+    open(my $file, "<", $ARGV[0]) or exit 1;
+    my ($end, $pos, @extents) = (-s $file, 0);
+    while ($pos < $end) {
+      my $data = sysseek($file, $pos, 3);   # SEEK_DATA
+      last unless defined $data;
+      my $hole = sysseek($file, $data, 4);  # SEEK_HOLE
+      push @extents, ($data + 0) . "+" . ($hole - $data);
+      $pos = $hole;
+    }
+    print @extents ? join(",", @extents) : "none";
+  ' "$1" 2>/dev/null) || EXTENTS="-"
+}
+
+# Load the extents of the sparse files listed in the manifest into SPARSE_EXTENTS and SPARSE_SIZE.
+# With "all", the decoded path, size, mtime, hash and flags of every entry also go to ENTRY_PATH,
+# ENTRY_SIZE, ENTRY_MTIME, ENTRY_HASH and ENTRY_FLAGS, and ENTRY_BY_HASH names an entry sent
+# plain for each hash, the object the "same" entries of its twins are restored from.
+load_manifest() {
+  local name root path size mtime extents hash flags
+  declare -gA SPARSE_EXTENTS=() SPARSE_SIZE=() ENTRY_PATH=() ENTRY_SIZE=() ENTRY_MTIME=() ENTRY_HASH=() ENTRY_FLAGS=()
+  declare -gA ENTRY_BY_HASH=()
+  [[ -f "$MANIFEST" ]] || return
+  while IFS=$'\t' read -r name root path size mtime extents hash flags; do
+    printf -v name '%b' "$name"
+    if [[ "$extents" != "-" ]]; then
+      SPARSE_EXTENTS[$name]=$extents
+      SPARSE_SIZE[$name]=$size
+    fi
+    if [[ "$1" == "all" ]]; then
+      printf -v root '%b' "$root"
+      printf -v path '%b' "$path"
+      ENTRY_PATH[$name]="${root%/}/$path"
+      ENTRY_SIZE[$name]=$size
+      ENTRY_MTIME[$name]=$mtime
+      ENTRY_HASH[$name]=${hash:--}
+      ENTRY_FLAGS[$name]=${flags:--}
+      [[ "${hash:--}" != "-" && "${flags:--}" == "-" && "$extents" == "-" ]] && ENTRY_BY_HASH[$hash]=$name
+    fi
+  done < <(awk -F '\t' -v all="$1" '!/^#/ && (all == "all" || $6 != "-")' "$MANIFEST")
+}
+
+# Print a manifest update for an entry: name, size, mtime, extents, hash and flags.
+# The identity is "size mtime ctime" as taken by snapshot_files, empty fields keep the manifest value.
+manifest_update() {
+  local size="${2%% *}" mtime="${2#* }"
+  manifest_escape "$1"
+  # One short write per line keeps the lines of parallel workers whole
+  printf '%s\t%s\t%s\t%s\t%s\t%s\n' "$ESCAPED" "$size" "${mtime%% *}" "$3" "$4" "$5" >> "$WORK_DIR/updates"
+}
+
+# Rewrite a manifest with the updates collected in WORK_DIR/updates, then forget them
+apply_updates() {
+  [[ -s "$WORK_DIR/updates" ]] || return 0
+  awk -F '\t' -v OFS='\t' '
+    FILENAME != ARGV[2] { updates[$1] = $0; next }
+    /^#/ || !($1 in updates) { print; next }
+    {
+      split(updates[$1], field, "\t")
+      for (i = 2; i <= 6; i++) {
+        column = i + 2
+        if (field[i] != "") $column = field[i]
+        else if ($column == "") $column = "-"
+      }
+      print
+    }
+  ' "$WORK_DIR/updates" "$1" > "$1.new" && mv "$1.new" "$1"
+  : > "$WORK_DIR/updates"
+}
+
+# Take the identity "size mtime ctime" of files into the associative array named by $1.
+# Files that cannot be read are left out.
+snapshot_files() {
+  local -n snapshot_ref="$1"
+  shift
+  local present=() name line i=0
+  snapshot_ref=()
+  for name in "$@"; do
+    [[ -e "$name" ]] && present+=("$name")
+  done
+  (( ${#present[@]} > 0 )) || return
+  while IFS= read -r line; do
+    snapshot_ref[${present[i++]}]=$line
+  done < <(stat -c '%s %.9Y %.9Z' -- "${present[@]}" 2>/dev/null)
+  # A file vanished in between, the lines no longer match the names
+  (( i == ${#present[@]} )) || snapshot_ref=()
+}
+
+# Fold the log of the hash cache into its table, keeping the newest entry of every file. The log
+# is moved aside first so runs appending meanwhile start a new one; a busy cache is left alone.
+compact_hash_cache() {
+  local lock
+  [[ -s "$HASH_CACHE.log" ]] || return 0
+  exec {lock}> "$HASH_CACHE.lock"
+  if flock -n "$lock"; then
+    mv "$HASH_CACHE.log" "$HASH_CACHE.merging"
+    [[ -f "$HASH_CACHE" ]] || : > "$HASH_CACHE"
+    # A stable sort keeps the table before the log for the same file, the last one wins
+    LC_ALL=C sort -z -s -t $'\t' -k1,1 "$HASH_CACHE" "$HASH_CACHE.merging" |
+      awk -v RS='\0' -v ORS='\0' -F '\t' 'NR > 1 && $1 != key { print line } { key = $1; line = $0 } END { if (NR) print line }' \
+      > "$HASH_CACHE.new" && mv "$HASH_CACHE.new" "$HASH_CACHE" && rm -f "$HASH_CACHE.merging"
+  fi
+  exec {lock}>&-
+}
+
+# Load the cached hashes of the NUL separated files of $1 whose identity has not changed into
+# CACHED_HASH, as "size mtime ctime hash". The cache is a table sorted by "device:inode" with
+# the identity and hash of each file, joined in one pass with the identities of the files.
+load_hash_cache() {
+  local name identity hash
+  declare -gA CACHED_HASH=()
+  mkdir -p "${HASH_CACHE%/*}" 2>/dev/null || return 0
+  compact_hash_cache
+  [[ -s "$HASH_CACHE" ]] || return 0
+  while IFS= read -r -d '' name && IFS= read -r -d '' identity && IFS= read -r -d '' hash; do
+    CACHED_HASH[$name]="$identity $hash"
+  done < <(LC_ALL=C join -z -t $'\t' -o 1.2,1.3,2.2,2.3 "$HASH_CACHE" \
+             <(xargs -0 -r stat --printf '%d:%i\t%s %.9Y %.9Z\t%n\0' -- < "$1" 2>/dev/null | LC_ALL=C sort -z -t $'\t' -k1,1) |
+           awk -v RS='\0' -v ORS='\0' -F '\t' '$1 == $3 { print $4; print $1; print $2 }')
+}
+
+# Hash a large file as a tree, its TREE_CHUNK leaves read with pread by JOBS processes at once.
+# "sha256-tree:<hex>" is the sha256 of the sha256 of every leaf, stored in TREE_HASH; empty on failure.
+tree_hash() {
+  TREE_HASH=$(perl -MDigest::SHA=sha256_hex -e '
+    my ($file, $chunk, $jobs) = @ARGV;
+    my $size = -s $file;
+    defined $size or exit 1;
+    my $leaves = int(($size + $chunk - 1) / $chunk) || 1;
+    my (@readers, @digests);
+    my $zeros = "\0" x (1 << 20);
+    sub zeros {
+      my ($sha, $count) = @_;
+      $sha->add(substr($zeros, 0, $count < 1 << 20 ? $count : 1 << 20)), $count -= 1 << 20 while $count > 0;
+    }
+    for my $worker (0 .. ($jobs < $leaves ? $jobs : $leaves) - 1) {
+      pipe(my $reader, my $writer) or exit 1;
+      my $pid = fork() // exit 1;
+      if (!$pid) {
+        close $reader;
+        open(my $in, "<", $file) or exit 1;
+        binmode $in;
+        my ($buffer, $empty, @sums);
+        LEAF: for (my $leaf = $worker; $leaf < $leaves; $leaf += $jobs) {
+          my ($sha, $pos) = (Digest::SHA->new(256), $leaf * $chunk);
+          my $end = $pos + $chunk < $size ? $pos + $chunk : $size;
+          # Holes are hashed as zeros without reading them
+          while ($pos < $end) {
+            my $data = sysseek($in, $pos, 3);   # SEEK_DATA
+            $data = defined $data ? ($data < $end ? $data + 0 : $end) : $!{ENXIO} ? $end : $pos;
+            if ($data == $end && $end - $pos == $chunk) {
+              # Full leaves without data all have the same digest
+              $empty //= do { my $zero = Digest::SHA->new(256); zeros($zero, $chunk); $zero->hexdigest };
+              push @sums, "$leaf $empty\n";
+              next LEAF;
+            }
+            zeros($sha, $data - $pos);
+            last if ($pos = $data) >= $end;
+            my $hole = sysseek($in, $pos, 4);   # SEEK_HOLE
+            $hole = $end unless defined $hole && $hole > $pos && $hole < $end;
+            sysseek($in, $pos, 0);
+            while ($pos < $hole) {
+              my $read = sysread($in, $buffer, $hole - $pos < 1 << 20 ? $hole - $pos : 1 << 20) or exit 1;
+              $sha->add($buffer);
+              $pos += $read;
+            }
+          }
+          push @sums, "$leaf " . $sha->hexdigest . "\n";
+        }
+        # Written at the end, a full pipe would stop the worker while the others are read
+        print $writer @sums;
+        exit 0;
+      }
+      close $writer;
+      push @readers, $reader;
+    }
+    for my $reader (@readers) {
+      while (<$reader>) {
+        my ($leaf, $hex) = split;
+        $digests[$leaf] = pack("H*", $hex);
+      }
+    }
+    while (wait() > 0) { exit 1 if $?; }
+    exit 1 if grep { !defined } @digests[0 .. $leaves - 1];
+    print sha256_hex(join "", @digests);
+  ' "$1" "$TREE_CHUNK" "$JOBS" 2>/dev/null) && TREE_HASH="sha256-tree:$TREE_HASH" || TREE_HASH=""
+}
+
+# Print "<hex>  <file>" NUL terminated for each file like sha256sum -z, hashing the holes of
+# sparse files as zeros without reading them
+sparse_sha256() {
+  perl -MDigest::SHA -e '
+    my ($zeros, $buffer) = ("\0" x (1 << 20));
+    FILE: for my $file (@ARGV) {
+      open(my $in, "<", $file) or next;
+      my ($sha, $pos, $end) = (Digest::SHA->new(256), 0, -s $in);
+      while ($pos < $end) {
+        my $data = sysseek($in, $pos, 3);   # SEEK_DATA
+        $data = defined $data ? ($data < $end ? $data + 0 : $end) : $!{ENXIO} ? $end : $pos;
+        for (; $pos < $data; $pos += length $buffer) {
+          $buffer = substr($zeros, 0, $data - $pos);
+          $sha->add($buffer);
+        }
+        last if $pos >= $end;
+        my $hole = sysseek($in, $pos, 4);   # SEEK_HOLE
+        $hole = $end unless defined $hole && $hole > $pos && $hole < $end;
+        sysseek($in, $pos, 0);
+        while ($pos < $hole) {
+          my $read = sysread($in, $buffer, $hole - $pos < 1 << 20 ? $hole - $pos : 1 << 20) or next FILE;
+          $sha->add($buffer);
+          $pos += $read;
+        }
+      }
+      print $sha->hexdigest, "  $file\0";
+    }
+  ' "$@"
+}
+
+# Tell whether a file has a hash of the manifest, computing it the same way
+check_hash() {
+  local sum
+  case $2 in
+    sha256-tree:*)
+      tree_hash "$1"
+      [[ "$TREE_HASH" == "$2" ]]
+      ;;
+    *)
+      read -r sum _ < <(sha256sum < "$1")
+      [[ "sha256:$sum" == "$2" ]]
+      ;;
+  esac
+}
+
+# Hash files with sha256, storing "sha256:<hex>" in the associative array named by $1. Files whose
+# identity "size mtime ctime" in the array named by $2 matches the hash cache are not read again;
+# the others are added to the cache when they kept that identity while they were hashed.
+# Files of TREE_MIN_SIZE bytes or more get a sha256-tree hash, read in parallel. Holes are
+# never read, they are hashed as the zeros they stand for.
+hash_files() {
+  local -n hashes_ref="$1" identities_ref="$2"
+  shift 2
+  local record identity name cached misses=() small=()
+  hashes_ref=()
+  for name in "$@"; do
+    cached=${CACHED_HASH[$name]}
+    if [[ -n "$cached" && "${cached% *}" == "${identities_ref[$name]}" ]]; then
+      hashes_ref[$name]=${cached##* }
+    else
+      misses+=("$name")
+    fi
+  done
+  (( ${#misses[@]} > 0 )) || return 0
+  for name in "${misses[@]}"; do
+    identity=${identities_ref[$name]}
+    # A file that vanished since it was listed has no identity and no hash
+    [[ -n "$identity" ]] || continue
+    # Without perl, large files get a plain sha256
+    if (( ${identity%% *} >= TREE_MIN_SIZE && HAVE_PERL )); then
+      tree_hash "$name"
+      [[ -z "$TREE_HASH" ]] || hashes_ref[$name]=$TREE_HASH
+    else
+      small+=("$name")
+    fi
+  done
+  # Files with fewer blocks than bytes have holes, hashed without reading them
+  local blocks size plain=() sparse=()
+  (( ${#small[@]} > 0 )) && while IFS=$'\t' read -r -d '' blocks size name; do
+    (( blocks * 512 < size && HAVE_PERL )) && sparse+=("$name") || plain+=("$name")
+  done < <(stat --printf '%b\t%s\t%n\0' -- "${small[@]}" 2>/dev/null)
+  while IFS= read -r -d '' record; do
+    hashes_ref[${record:66}]="sha256:${record:0:64}"
+  done < <((( ${#plain[@]} == 0 )) || sha256sum -z -- "${plain[@]}" 2>/dev/null
+           (( ${#sparse[@]} == 0 )) || sparse_sha256 "${sparse[@]}" 2>/dev/null)
+  [[ -d "${HASH_CACHE%/*}" ]] || return 0
+  # One short write per entry keeps the lines of parallel workers whole
+  while IFS=$'\t' read -r -d '' record identity name; do
+    [[ -n "${hashes_ref[$name]}" && "$identity" == "${identities_ref[$name]}" ]] &&
+      printf '%s\t%s\t%s\0' "$record" "$identity" "${hashes_ref[$name]}" >> "$HASH_CACHE.log"
+  done < <(stat --printf '%d:%i\t%s %.9Y %.9Z\t%n\0' -- "${misses[@]}" 2>/dev/null)
+}
+
+# Hash a batch of planned source/target pairs, reading again the files that change meanwhile
+hash_batch() {
+  local source pending=() changed
+  local -A target=() before=() after=() hashes=() tries=()
+  while (( $# > 0 )); do
+    pending+=("$1")
+    target[$1]=$2
+    shift 2
+  done
+  while (( ${#pending[@]} > 0 )); do
+    snapshot_files before "${pending[@]}"
+    hash_files hashes before "${pending[@]}"
+    snapshot_files after "${pending[@]}"
+    changed=()
+    for source in "${pending[@]}"; do
+      if [[ -n "${before[$source]}" && "${before[$source]}" == "${after[$source]}" && -n "${hashes[$source]}" ]]; then
+        manifest_update "${target[$source]}" "${after[$source]}" "" "${hashes[$source]}" -
+      elif (( ${tries[$source]:-0} < REREAD_RETRIES )); then
+        tries[$source]=$(( ${tries[$source]:-0} + 1 ))
+        changed+=("$source")
+      else
+        echo "$source kept changing while it was hashed"
+        manifest_update "${target[$source]}" "${after[$source]}" "" "${hashes[$source]}" changed
+      fi
+    done
+    pending=("${changed[@]}")
+  done
+}
+
+# Start publishing the state of this run to STATS_DIR/PID for --status. The file is rewritten
+# in a single write and ends with "end", readers take another copy until they see it whole.
+start_stats() {
+  mkdir -p -m 700 "$STATS_DIR" 2>/dev/null || return 0
+  STATS_FILE="$STATS_DIR/$$"
+  manifest_escape "$*"
+  STATS_COMMAND=$ESCAPED
+  now_ms
+  STATS_STARTED=$NOW_MS
+  trap 'rm -rf "$WORK_DIR"; rm -f "$STATS_FILE" "$STATS_FILE".*' EXIT
+  set_phase starting
+}
+
+# Enter a phase of the run with its number of items, 0 when unknown
+set_phase() {
+  PHASE="$1" PHASE_TOTAL="${2:-0}" PHASE_DONE=0
+  now_ms
+  PHASE_STARTED=$NOW_MS
+  publish_stats
+}
+
+# Count items of the current phase as done, publishing at most every STATS_INTERVAL_MS
+add_progress() {
+  (( PHASE_DONE += $1 ))
+  now_ms
+  (( NOW_MS - STATS_PUBLISHED < STATS_INTERVAL_MS )) || publish_stats
+}
+
+# Rewrite the statistics of this run; workers only publish their own state, see run_worker
+publish_stats() {
+  [[ -n "$STATS_FILE" && "$BASHPID" == "$$" ]] || return 0
+  now_ms
+  STATS_PUBLISHED=$NOW_MS
+  manifest_escape "$PWD"
+  printf 'pid %s\njob %s\nfolder %s\ncommand %s\nstarted %s\nphase %s\nphase_started %s\ndone %s\ntotal %s\nupdated %s\nend\n' \
+    "$$" "${FILINATOR_JOB:--}" "$ESCAPED" "$STATS_COMMAND" "$STATS_STARTED" "$PHASE" "$PHASE_STARTED" \
+    "$PHASE_DONE" "$PHASE_TOTAL" "$NOW_MS" > "$STATS_FILE"
+}
+
+# Run one batch of run_batches, showing "batch started items first_item" to --status while it runs
+run_worker() {
+  local count="$1" first="$2" status
+  shift 2
+  if [[ -n "$STATS_FILE" ]]; then
+    now_ms
+    manifest_escape "$first"
+    printf '%s %s %s %s\n' "$BATCH_INDEX" "$NOW_MS" "$count" "$ESCAPED" > "$STATS_FILE.worker.$BASHPID"
+  fi
+  "$@"
+  status=$?
+  [[ -z "$STATS_FILE" ]] || rm -f "$STATS_FILE.worker.$BASHPID"
+  return $status
+}
+
+# Copy the NUL separated records of stdin, of $1 items with the file first, in the order of the
+# first data extent of the files on their device as told by the FS_IOC_FIEMAP ioctl, sorting
+# PHYSICAL_WINDOW records at a time. Files without a known extent keep their order, first.
+physical_order() {
+  perl -e '
+    use sort "stable";
+    my ($size, $window, @window) = @ARGV;
+    $/ = "\0";
+    sub flush {
+      print map { $_->[2] } sort { $a->[0] <=> $b->[0] || $a->[1] <=> $b->[1] } @window;
+      @window = ();
+    }
+    while (defined(my $file = <STDIN>)) {
+      my $record = $file;
+      $record .= <STDIN> // "" for 2 .. $size;
+      chomp $file;
+      my ($device, $offset) = ((lstat $file)[0] // 0, -1);
+      if (-f _ && open(my $handle, "<", $file)) {
+        # struct fiemap asking for one extent, with its fe_physical 40 bytes in and fe_flags at 72.
+        # Data not written out yet has no place on the disk (FIEMAP_EXTENT_UNKNOWN).
+        my $fiemap = pack("QQLLLL", 0, ~0, 0, 0, 1, 0) . ("\0" x 56);
+        if (ioctl($handle, 0xC020660B, $fiemap) && unpack("x20L", $fiemap) > 0 && !(unpack("x72L", $fiemap) & 2)) {
+          $offset = unpack("x40Q", $fiemap);
+        }
+        close $handle;
+      }
+      push @window, [$device, $offset, $record];
+      flush() if @window >= $window;
+    }
+    flush();
+  ' "$1" "$PHYSICAL_WINDOW"
+}
+
+# Run a function on batches of the NUL separated items of stdin, JOBS batches at a time.
+# Each batch runs in a subshell with its number in BATCH_INDEX. Finished batches count as progress
+# of the current phase; all but the last are full.
+run_batches() {
+  local size="$1" item batch=() running=0 finished=0 handed=0 counted=0
+  shift
+  BATCH_INDEX=0
+  while (( !finished )); do
+    IFS= read -r -d '' item && batch+=("$item") || finished=1
+    if (( ${#batch[@]} >= size || (finished && ${#batch[@]} > 0) )); then
+      if (( running >= JOBS )); then
+        wait -n
+        (( running--, counted += size ))
+        add_progress "$size"
+      fi
+      run_worker "${#batch[@]}" "${batch[0]}" "$@" "${batch[@]}" &
+      (( running++, BATCH_INDEX++, handed += ${#batch[@]} ))
+      batch=()
+    fi
+  done
+  wait
+  add_progress $(( handed - counted ))
+}
+
+# Copy only the data extents of a sparse file, back to back
+compact_sparse() {
+  local source="$1" target="$2" extent
+  for extent in ${3//,/ }; do
+    [[ "$extent" == "none" ]] && continue
+    dd if="$source" bs=1M iflag=skip_bytes,count_bytes skip="${extent%+*}" count="${extent#*+}" status=none
+  done > "$target"
+}
+
+# Rebuild a sparse file from its compacted data, leaving the holes unallocated
+expand_sparse() {
+  local source="$1" target="$2" size="$3" extent pos=0
+  truncate -s "$size" "$target"
+  for extent in ${4//,/ }; do
+    [[ "$extent" == "none" ]] && continue
+    dd if="$source" of="$target" bs=1M iflag=skip_bytes,count_bytes oflag=seek_bytes conv=notrunc \
+      skip="$pos" seek="${extent%+*}" count="${extent#*+}" status=none
+    (( pos += ${extent#*+} ))
+  done
+}
+
+# Deallocate the holes of a file that was restored with its zeros written out
+punch_holes() {
+  local file="$1" size="$2" extent pos=0
+  for extent in ${3//,/ } "$size+0"; do
+    [[ "$extent" == "none" ]] && continue
+    if (( ${extent%+*} > pos )); then
+      fallocate --punch-hole --offset "$pos" --length $(( ${extent%+*} - pos )) "$file"
+    fi
+    pos=$(( ${extent%+*} + ${extent#*+} ))
+  done
+}
+
+# Name of the delta of generation $2 of a file on the host, stored in DELTA_NAME
+delta_name() {
+  printf -v DELTA_NAME '.filinator-delta.%06d.%s' "$2" "$1"
+}
+
+# Compare a file block by block with the signature of its last upload, kept in DELTA_STATE as
+# "generation chain_head block_size" followed by the sha256 of every block. The changed blocks go
+# to $STAGING/NAME.delta behind a "filinator-delta GEN PARENT SIZE BLOCK INDEXES" line and the
+# new signature to $STAGING/NAME.sums. Sets DELTA_GEN[NAME] to the generation of the delta,
+# 0 when the whole file is sent, or "same" when nothing changed.
+make_delta() {
+  local name="$1" gen=0 head=0 block=0 changed total old=/dev/null
+  [[ -f "$DELTA_STATE/$name" ]] && read -r gen head block _ < "$DELTA_STATE/$name"
+  # Only a signature with the current block size can be compared
+  (( block == DELTA_BLOCK )) && old="$DELTA_STATE/$name"
+  read -r changed total < <(perl -MDigest::SHA=sha256_hex -e '
+    my ($file, $old, $sums, $delta, $block, $header) = @ARGV;
+    open(my $in, "<", $file) or exit 1;
+    binmode $in;
+    my (@old, @changed, $buffer);
+    if ($old ne "/dev/null") { open(my $s, "<", $old) or exit 1; <$s>; chomp(@old = <$s>); }
+    open(my $new, ">", $sums) or exit 1;
+    open(my $data, ">", "$delta.data") or exit 1;
+    binmode $data;
+    my ($index, $size) = (0, 0);
+    while ((my $read = read($in, $buffer, $block)) > 0) {
+      my $sum = sha256_hex($buffer);
+      print $new "$sum\n";
+      # Without a signature every block is new, there is no delta to write
+      if ($old eq "/dev/null") {
+      } elsif (!defined $old[$index] || $old[$index] ne $sum) {
+        push @changed, $index;
+        print $data $buffer;
+      }
+      $index++;
+      $size += $read;
+    }
+    close $data;
+    open(my $out, ">", $delta) or exit 1;
+    binmode $out;
+    printf $out "%s %d %d %s\n", $header, $size, $block, @changed ? join(",", @changed) : "-";
+    open($data, "<", "$delta.data") or exit 1;
+    binmode $data;
+    print $out $buffer while read($data, $buffer, 1 << 20);
+    unlink "$delta.data";
+    print scalar(@changed), " ", ($old eq "/dev/null" ? -1 : $index), "\n";
+  ' "$name" "$old" "$STAGING/$name.sums" "$STAGING/$name.delta" "$DELTA_BLOCK" "filinator-delta $(( gen + 1 )) $head")
+  if [[ -z "$total" ]]; then
+    DELTA_GEN[$name]=0
+  elif (( total < 0 || changed * 2 > total )); then
+    # A delta rewriting most of the file is not worth the chain it adds
+    DELTA_GEN[$name]=0
+  elif (( changed == 0 && total == $(wc -l < "$old") - 1 )); then
+    DELTA_GEN[$name]=same
+  else
+    DELTA_GEN[$name]=$(( gen + 1 ))
+  fi
+  [[ "${DELTA_GEN[$name]}" == [1-9]* ]] || rm -f "$STAGING/$name.delta"
+}
+
+# Keep the signature of a file once it is on the host, after "generation chain_head block_size chain_start".
+# The chain of deltas starts over after a full upload.
+save_signature() {
+  local name="$1" gen=0 head=0 block start=0
+  [[ -f "$STAGING/$name.sums" && "${DELTA_GEN[$name]}" != "same" ]] || return 0
+  [[ -f "$DELTA_STATE/$name" ]] && read -r gen head block start < "$DELTA_STATE/$name"
+  if [[ "${DELTA_GEN[$name]}" == [1-9]* ]]; then
+    gen=${DELTA_GEN[$name]}
+    (( head == 0 )) && start=$gen
+    head=$gen
+  else
+    head=0 start=0
+  fi
+  { echo "$gen $head $DELTA_BLOCK ${start:-1}"; cat "$STAGING/$name.sums"; } > "$DELTA_STATE/$name.new" &&
+    mv "$DELTA_STATE/$name.new" "$DELTA_STATE/$name"
+}
+
+# Bring a file restored from its full upload up to date with the chain of deltas ending at
+# generation $3, read from the folder $4 and listed in DELTA_CHAIN. Each delta names the
+# generation it applies to; they only write whole blocks, applying them twice is harmless.
+apply_deltas() {
+  local file="$1" name="$2" gen="$3" dir="$4" chain=()
+  if (( !HAVE_PERL )); then
+    echo "Cannot apply the deltas of $name without perl, it stays at an older version"
+    return 1
+  fi
+  while (( gen > 0 )); do
+    delta_name "$name" "$gen"
+    if [[ ! -f "$dir/$DELTA_NAME" ]]; then
+      echo "Missing delta $gen of $name, it stays at an older version"
+      return 1
+    fi
+    chain=("$dir/$DELTA_NAME" "${chain[@]}")
+    read -r _ _ gen _ < "$dir/$DELTA_NAME"
+  done
+  DELTA_CHAIN=("${chain[@]}")
+  perl -e '
+    my $file = shift;
+    open(my $out, "+<", $file) or die "Cannot update $file\n";
+    binmode $out;
+    for my $delta (@ARGV) {
+      open(my $in, "<", $delta) or die "Cannot read $delta\n";
+      binmode $in;
+      my (undef, undef, undef, $size, $block, $indexes) = split " ", scalar <$in>;
+      for my $index ($indexes eq "-" ? () : split /,/, $indexes) {
+        my $length = $size - $index * $block;
+        $length = $block if $length > $block;
+        read($in, my $buffer, $length) == $length or die "$delta is truncated\n";
+        sysseek($out, $index * $block, 0);
+        syswrite($out, $buffer);
+      }
+      truncate($out, $size);
+    }
+  ' "$file" "${chain[@]}"
+}
+
+# Train a zstd dictionary for each extension with DICT_MIN_FILES small files or more among the NUL
+# separated names of $1, on a random sample of them. An extension is trained once, later runs
+# keep its dictionary so what was sent with it stays readable. DICT_ID maps extensions to theirs.
+train_dicts() {
+  local file ext id samples=()
+  declare -gA DICT_ID=()
+  mkdir -p "$DICT_STATE"
+  perl -e '
+    my ($list, $state, $work, $max, $min, $count) = @ARGV;
+    local $/ = "\0";
+    open(my $in, "<", $list) or exit 1;
+    my %files;
+    while (my $name = <$in>) {
+      chomp $name;
+      next if $name =~ /^\.filinator-/ || $name !~ /\.([A-Za-z0-9]{1,16})$/;
+      my $ext = lc $1;
+      next if -e "$state/ext.$ext";
+      my $size = -s $name;
+      push @{$files{$ext}}, $name if $size && $size <= $max;
+    }
+    for my $ext (grep { @{$files{$_}} >= $min } keys %files) {
+      my $files = $files{$ext};
+      # The first $count of a partial Fisher-Yates shuffle
+      my $take = @$files < $count ? @$files : $count;
+      for my $i (0 .. $take - 1) {
+        my $j = $i + int rand(@$files - $i);
+        @$files[$i, $j] = @$files[$j, $i];
+      }
+      open(my $out, ">", "$work/samples.$ext") or exit 1;
+      print $out "$_\0" for @$files[0 .. $take - 1];
+    }
+  ' "$1" "$DICT_STATE" "$WORK_DIR" "$DICT_MAX_SIZE" "$DICT_MIN_FILES" "$DICT_SAMPLES"
+  for file in "$WORK_DIR"/samples.*; do
+    [[ -f "$file" ]] || continue
+    ext=${file##*.}
+    mapfile -d '' samples < "$file"
+    # Identifiers below 32768 are reserved by zstd
+    id=$(( (RANDOM << 15 | RANDOM) + 32768 ))
+    if zstd -q --train --maxdict="$DICT_SIZE" --dictID="$id" -o "$DICT_STATE/dict.$id" -- "${samples[@]}" 2>/dev/null; then
+      echo "$id" > "$DICT_STATE/ext.$ext"
+    fi
+    rm -f "$file"
+  done
+  for file in "$DICT_STATE"/ext.*; do
+    [[ -f "$file" ]] || continue
+    read -r id < "$file"
+    DICT_ID[${file##*.}]=$id
+  done
+}
+
+# Tell whether a file starts with a zstd frame
+zstd_frame() {
+  local magic
+  read -r magic < <(od -An -tx1 -N4 "$1")
+  [[ "$magic" == "28 b5 2f fd" ]]
+}
+
+# Load the extensions that compressed to more than COMPRESS_HOPELESS percent in the last runs into HOPELESS
+load_compressibility() {
+  local ext
+  declare -gA HOPELESS=()
+  [[ -f "$COMPRESS_STATE" ]] || return 0
+  while read -r ext; do
+    HOPELESS[$ext]=1
+  done < <(awk -F '\t' -v least="$COMPRESS_LEARN_BYTES" -v percent="$COMPRESS_HOPELESS" '
+    $2 >= least && $3 * 100 > $2 * percent { print $1 }
+  ' "$COMPRESS_STATE")
+}
+
+# Add what this run compressed to COMPRESS_STATE, "extension<TAB>bytes<TAB>compressed bytes" lines.
+# The older totals are halved every run, so the verdict on an extension follows its files.
+save_compressibility() {
+  [[ -s "$WORK_DIR/compressibility" ]] || return 0
+  [[ -f "$COMPRESS_STATE" ]] || : > "$COMPRESS_STATE"
+  awk -F '\t' '
+    FILENAME == ARGV[1] { read[$1] += $2 / 2; wrote[$1] += $3 / 2; next }
+    { read[$1] += $2; wrote[$1] += $3 }
+    END { for (ext in read) if (read[ext] >= 1) printf "%s\t%d\t%d\n", ext, read[ext], wrote[ext] }
+  ' "$COMPRESS_STATE" "$WORK_DIR/compressibility" > "$COMPRESS_STATE.new" && mv "$COMPRESS_STATE.new" "$COMPRESS_STATE"
+}
+
+# Move the compression level shared by the workers one step after a batch. Compressing for longer than
+# sending keeps the link waiting on the processor, the level goes down; compressing in under a quarter
+# of the sending time leaves the processor idle while the link is the limit, the level goes up.
+balance_level() {
+  local compress_ms="$1" transfer_ms="$2" level
+  exec 9>> "$WORK_DIR/level.lock"
+  flock 9
+  read -r level < "$WORK_DIR/level"
+  if (( compress_ms > transfer_ms && level > COMPRESS_MIN_LEVEL )); then
+    (( level-- ))
+  elif (( compress_ms * 4 < transfer_ms && level < COMPRESS_MAX_LEVEL )); then
+    (( level++ ))
+  fi
+  # Replaced whole, the workers read it without the lock
+  echo "$level" > "$WORK_DIR/level.new" && mv "$WORK_DIR/level.new" "$WORK_DIR/level"
+  flock -u 9
+}
+
+# Compress a file into $STAGING/NAME.zst at the level of WORK_DIR/level, small ones with the dictionary
+# of their extension. COMPRESSED[NAME] gets the flag of the manifest, "zstd" or "zstd=ID", when the
+# result is smaller and stays empty otherwise. Sizes before and after go to WORK_DIR/compressibility.
+compress_file() {
+  local name="$1" size="$2" ext=${1##*.} level packed dict=()
+  COMPRESSED[$name]=""
+  [[ "$name" == *.* && "$ext" =~ ^[A-Za-z0-9]{1,16}$ ]] && ext=${ext,,} || ext=-
+  [[ "$name" != .filinator-* && -z "${SPARSE_EXTENTS[$name]}" ]] || return 0
+  (( ${size:-0} > 0 && size <= COMPRESS_MAX_SIZE )) || return 0
+  # Files with a twin go plain, the twin is restored from the very same object
+  [[ -z "${TWIN_IDENTITY[$name]}" ]] || return 0
+  # Files sent as deltas are mostly sent in part
+  (( DELTA && size >= DELTA_MIN_SIZE )) && return 0
+  # Types that never shrank are only tried now and then, in case that changed
+  [[ -n "${HOPELESS[$ext]}" ]] && (( RANDOM % COMPRESS_PROBE )) && return 0
+  # Restores take a file starting with a zstd frame for one sent compressed
+  zstd_frame "$name" && return 0
+  (( size <= DICT_MAX_SIZE )) && [[ -n "${DICT_ID[$ext]}" ]] && dict=(-D "$DICT_STATE/dict.${DICT_ID[$ext]}")
+  read -r level < "$WORK_DIR/level"
+  zstd -q -f -"$level" "${dict[@]}" -o "$STAGING/$name.zst" -- "$name" 2>/dev/null || return 0
+  packed=$(stat -c %s "$STAGING/$name.zst")
+  printf '%s\t%s\t%s\n' "$ext" "$size" $(( packed < size ? packed : size )) >> "$WORK_DIR/compressibility"
+  if (( packed < size )); then
+    COMPRESSED[$name]=zstd${dict:+=${DICT_ID[$ext]}}
+  else
+    rm -f "$STAGING/$name.zst"
+  fi
+}
+
+# Undo the compression of a file sent with --compress, with the dictionary named in its flags if any,
+# read from the folder $3. Files not starting with a zstd frame were never sent, as when decoding in place.
+decompress_file() {
+  local file="$1" name="$2" dir="$3" id dict=()
+  [[ ",${ENTRY_FLAGS[$name]}," =~ ,zstd(=([0-9]+))?, ]] || return 0
+  id=${BASH_REMATCH[2]}
+  zstd_frame "$file" || return 0
+  [[ -n "$id" ]] && dict=(-D "$dir/.filinator-dict.$id")
+  if ! zstd -q -d -f "${dict[@]}" -o "$file.plain" -- "$file" 2>/dev/null; then
+    rm -f "$file.plain"
+    echo "Cannot decompress $name, it is damaged${id:+ or its dictionary $id is missing}"
+    return 1
+  fi
+  mv "$file.plain" "$file"
+}
+
+# Resolve the roots to absolute paths, dropping duplicates and nested roots
+resolve_roots() {
+  local root resolved other keep
+  ROOTS=()
+  for root in "$@"; do
+    if [[ ! -d "$root" ]]; then
+      echo "Not a directory: $root"
+      exit 1
+    fi
+    resolved=$(readlink -f "$root")
+    keep=1
+    for other in "${ROOTS[@]}"; do
+      # An identical or enclosing root already covers this one
+      if [[ "$resolved" == "$other" || "$resolved" == "${other%/}/"* ]]; then
+        keep=0
+      fi
+    done
+    if (( keep )); then
+      # Drop previously accepted roots nested below this one
+      local kept=()
+      for other in "${ROOTS[@]}"; do
+        [[ "$other" == "${resolved%/}/"* ]] || kept+=("$other")
+      done
+      ROOTS=("${kept[@]}" "$resolved")
+    fi
+  done
 }
 
-# Encode files by replacing characters in the file path
+# List a root like find -printf '%y\0%P\0%s\0%T@\0%b\0'. With --incremental, folders whose mtime
+# did not change since the walk kept in $2 are not read again, their entries come from it; only
+# the folders that changed are listed, new ones in full, then all the files are stat'ed at once.
+# Files with the size and mtime of the last walk are left out. The new walk goes to $3 as
+# "type rel mtime size" records, "." being the root.
+walk_root() {
+  local root="$1" state="$2" new="$3" prefix="${1%/}/"
+  if (( !INCREMENTAL )); then
+    find "$root" -mindepth 1 -printf '%y\0%P\0%s\0%T@\0%b\0'
+    return
+  fi
+  [[ -f "$state" ]] || state=/dev/null
+  # The mtime of the root and of the folders known from the last walk
+  awk -v RS='\0' -v ORS='\0' -v prefix="$prefix" '
+    BEGIN { print prefix }
+    { type = $0; getline rel; getline; getline; if (type == "d" && rel != ".") print prefix rel }
+  ' "$state" | xargs -0 -r stat --printf '%n\0%F\0%.10Y\0' -- 2>/dev/null > "$new.dirs"
+  # Keep the entries of the unchanged folders, list the changed ones
+  awk -v RS='\0' -v ORS='\0' -v OFS='\0' -v prefix="$prefix" -v changed="$new.changed" -v kept="$new.kept" -v pass=1 '
+    function parent(rel) { return rel ~ /\// ? substr(rel, 1, match(rel, /\/[^\/]*$/) - 1) : "." }
+    pass == 1 {
+      path = $0; getline type; getline mtime
+      if (type == "directory") now[path == prefix ? "." : substr(path, length(prefix) + 1)] = mtime
+      next
+    }
+    { type = $0; getline rel; getline mtime; getline size }
+    pass == 2 && type == "d" && rel in now {
+      walked[rel] = 1
+      if (now[rel] == mtime) same[rel] = 1
+      else print (rel == "." ? prefix : prefix rel) > changed
+    }
+    pass == 3 && rel != "." && parent(rel) in same { print type, rel, mtime, size > kept }
+    END { if (!("." in walked)) print prefix > changed }
+  ' "$new.dirs" pass=2 "$state" pass=3 "$state"
+  : >> "$new.changed"
+  : >> "$new.kept"
+  xargs -0 -r sh -c 'exec find "$@" -mindepth 1 -maxdepth 1 -printf "%y\0%p\0%T@\0"' sh < "$new.changed" > "$new.listed" 2>/dev/null
+  # Folders the last walk did not know are new, walk them in full
+  awk -v RS='\0' -v ORS='\0' '
+    FILENAME == ARGV[1] { path = $0; getline type; getline; if (type == "directory") known[path]; next }
+    { type = $0; getline path; getline; if (type == "d" && !(path in known)) print path }
+  ' "$new.dirs" "$new.listed" |
+    xargs -0 -r sh -c 'exec find "$@" -mindepth 1 -printf "%y\0%p\0%T@\0"' sh >> "$new.listed" 2>/dev/null
+
+  # Gather every entry, stat the files in one go
+  awk -v RS='\0' -v ORS='\0' -v OFS='\0' -v prefix="$prefix" -v entries="$new.entries" '
+    FILENAME == ARGV[1] { path = $0; getline type; getline mtime; if (path == prefix) print "d", ".", mtime, "-" > entries; next }
+    FILENAME == ARGV[2] { type = $0; getline rel; getline mtime; getline size; print type, rel, mtime, size > entries; if (type != "d") print prefix rel; next }
+    { type = $0; getline path; getline mtime; print type, substr(path, length(prefix) + 1), mtime, "-" > entries; if (type != "d") print path }
+  ' "$new.dirs" "$new.kept" "$new.listed" | xargs -0 -r stat --printf '%n\0%s\0%.10Y\0%b\0' -- 2>/dev/null > "$new.files"
+  awk -v RS='\0' -v ORS='\0' -v OFS='\0' -v prefix="$prefix" -v new="$new" '
+    FILENAME == ARGV[1] { type = $0; getline rel; getline m; getline s; if (type == "f") old[rel] = s " " m; next }
+    FILENAME == ARGV[2] { path = $0; getline size[path]; getline mtime[path]; getline blocks[path]; next }
+    {
+      type = $0; getline rel; getline dirtime; getline
+      path = prefix rel
+      if (type == "d") {
+        print type, rel, dirtime, "-" > new
+        if (rel != ".") print type, rel, 0, dirtime, 0
+      } else if (path in size) {
+        print type, rel, mtime[path], size[path] > new
+        if (type != "f" || old[rel] != size[path] " " mtime[path]) print type, rel, size[path], mtime[path], blocks[path]
+      }
+    }
+  ' "$state" "$new.files" "$new.entries"
+}
+
+# Walk one root and write its part of the plan as NUL separated source/target pairs,
+# along with its manifest entries and the number of entries in each of its folders
+plan_root() {
+  local root="$1" index="$2" type rel size mtime blocks dir
+  local -A children=(["$root"]=0)
+  while IFS= read -r -d '' type && IFS= read -r -d '' rel && IFS= read -r -d '' size &&
+        IFS= read -r -d '' mtime && IFS= read -r -d '' blocks; do
+    [[ "$rel" == */* ]] && dir="${root%/}/${rel%/*}" || dir="$root"
+    children[$dir]=$(( ${children[$dir]:-0} + 1 ))
+    if [[ "$type" == "d" ]]; then
+      children[${root%/}/$rel]=${children[${root%/}/$rel]:-0}
+      continue
+    fi
+
+    # Skip encoding the script file, our own bookkeeping and anything that is not a regular file
+    if [[ "$type" == "f" && "${root%/}/$rel" != "$SCRIPT_PATH" && "${root%/}/$rel" != "$PWD"/.filinator-* ]]; then
+      # find prints ten decimals, stat nine
+      mtime=${mtime:0:${#mtime}-1}
+      encode_name "$root" "$rel"
+      printf '%s\0%s\0' "${root%/}/$rel" "$ENCODED"
+
+      # Sparse files use fewer blocks than their size, record where their data is
+      EXTENTS="-"
+      (( blocks * 512 < size )) && data_extents "${root%/}/$rel"
+      manifest_escape "$ENCODED"
+      printf '%s\t' "$ESCAPED" >> "$WORK_DIR/manifest.$index"
+      manifest_escape "$root"
+      printf '%s\t' "$ESCAPED" >> "$WORK_DIR/manifest.$index"
+      manifest_escape "$rel"
+      printf '%s\t%s\t%s\t%s\t-\t-\n' "$ESCAPED" "$size" "$mtime" "$EXTENTS" >> "$WORK_DIR/manifest.$index"
+    fi
+  done < <(walk_root "$root" "$WALK_STATE/${root//\//@}" "$WORK_DIR/walk.$index")
+
+  for dir in "${!children[@]}"; do
+    printf '%s\0%s\0' "$dir" "${children[$dir]}"
+  done > "$WORK_DIR/folders.$index"
+}
+
+# Keep the walks of an --incremental stream for the next one, once it is written
+save_walks() {
+  local i
+  (( INCREMENTAL )) || return 0
+  mkdir -p "$WALK_STATE" || return 1
+  for i in "${!ROOTS[@]}"; do
+    [[ -f "$WORK_DIR/walk.$i" ]] && mv "$WORK_DIR/walk.$i" "$WALK_STATE/${ROOTS[$i]//\//@}"
+  done
+}
+
+# Walk all roots concurrently and merge their plans, refusing colliding targets
+plan_encode() {
+  local i source target collisions
+  for i in "${!ROOTS[@]}"; do
+    plan_root "${ROOTS[$i]}" "$i" > "$WORK_DIR/plan.$i" &
+  done
+  wait
+  for i in "${!ROOTS[@]}"; do
+    cat "$WORK_DIR/plan.$i"
+  done > "$WORK_DIR/plan"
+  if (( PHYSICAL_ORDER )); then
+    physical_order 2 < "$WORK_DIR/plan" > "$WORK_DIR/plan.sorted" && mv "$WORK_DIR/plan.sorted" "$WORK_DIR/plan"
+  fi
+  # Nothing is renamed when streaming, names cannot collide
+  [[ -z "$STREAM" ]] || return 0
+
+  # Report targets planned twice and targets that already exist
+  collisions=$(
+    while IFS= read -r -d '' source && IFS= read -r -d '' target; do
+      printf '%s\0' "$target"
+      [[ -e "$target" ]] && printf '%s\0' "$target"
+    done < "$WORK_DIR/plan" | sort -z | uniq -zd | tr '\0' '\n'
+  )
+  if [[ -n "$collisions" ]]; then
+    echo "Encoding aborted, these names would collide:"
+    printf '%s\n' "$collisions"
+    exit 1
+  fi
+}
+
+# Forget one entry of a folder. A folder left without entries is removed at once,
+# which in turn releases its entry in the parent folder.
+release_entry() {
+  local dir="$1" count
+  while [[ -n "${CHILDREN[$dir]}" ]]; do
+    count=$(( ${CHILDREN[$dir]} - 1 ))
+    CHILDREN[$dir]=$count
+    # rmdir refuses folders that gained entries since the walk, an undercount only stops the cascade
+    (( count == 0 )) && [[ -z "${KEEP_FOLDERS[$dir]}" ]] && rmdir "$dir" 2>/dev/null || break
+    dir=${dir%/*}
+    [[ -n "$dir" ]] || dir="/"
+  done
+}
+
+# Load the folder entry counts of the walks and remove the folders that were already empty
+load_folders() {
+  local dir count
+  declare -gA CHILDREN=() KEEP_FOLDERS=(["$PWD"]=1)
+  for dir in "$@"; do
+    KEEP_FOLDERS[$dir]=1
+  done
+  while IFS= read -r -d '' dir && IFS= read -r -d '' count; do
+    CHILDREN[$dir]=$count
+  done < <(cat "$WORK_DIR"/folders.* 2>/dev/null)
+  for dir in "${!CHILDREN[@]}"; do
+    if [[ "${CHILDREN[$dir]}" == 0 && -z "${KEEP_FOLDERS[$dir]}" ]] && rmdir "$dir" 2>/dev/null; then
+      CHILDREN[$dir]=""
+      [[ "$dir" == */* ]] && release_entry "${dir%/*}"
+    fi
+  done
+}
+
+# Start a renamer for move_file: one perl process renaming NUL separated source/target pairs,
+# instead of an mv per file walking both paths from the root. It keeps the folders it renames in
+# open as a cache of directory handles, dropping the least recently used half when full, and names
+# files through /proc/self/fd/N/NAME so the kernel only looks up the last component.
+# The cache takes at most a quarter of the open file limit, the rest is left to the jobs.
+start_renamer() {
+  local limit
+  # move_file falls back to mv
+  (( HAVE_PERL )) || return 0
+  limit=$(ulimit -n)
+  [[ "$limit" == "unlimited" ]] && limit=4096
+  limit=$(( limit / 4 ))
+  (( limit > 1024 )) && limit=1024
+  (( limit < 1 )) && limit=1
+  coproc RENAMER {
+    perl -MFcntl -e '
+      my ($limit, $proc, $clock, %dirs, %used) = (shift, -d "/proc/self/fd", 0);
+      sub forget { close delete $dirs{$_} for @_; delete @used{@_}; }
+      sub at {
+        my ($dir, $base) = $_[0] =~ m{^(.*)/([^/]*)$} ? ($1 eq "" ? "/" : $1, $2) : (".", $_[0]);
+        return $_[0] unless $proc;
+        if (!$dirs{$dir}) {
+          if (keys %dirs >= $limit) {
+            my @oldest = sort { $used{$a} <=> $used{$b} } keys %dirs;
+            forget(@oldest[0 .. $#oldest / 2]);
+          }
+          sysopen($dirs{$dir}, $dir, O_RDONLY | O_DIRECTORY) or do { delete $dirs{$dir}; return $_[0]; };
+        }
+        $used{$dir} = ++$clock;
+        return "/proc/self/fd/" . fileno($dirs{$dir}) . "/$base";
+      }
+      $| = 1;
+      $/ = "\0";
+      while (defined(my $source = <STDIN>) and defined(my $target = <STDIN>)) {
+        chomp($source, $target);
+        if (rename(at($source), at($target))) {
+          print "0\n";
+        } else {
+          # A cached folder may have been removed and created again, open it afresh next time
+          print "$!\n";
+          forget(grep { $dirs{$_} } map { m{^(.*)/} ? ($1 eq "" ? "/" : $1) : "." } $source, $target);
+        }
+      }
+    ' "$limit"
+  }
+  RENAMER_OWNER=$BASHPID
+}
+
+# Close the renamer once the files are moved
+stop_renamer() {
+  [[ -n "$RENAMER_OWNER" ]] || return 0
+  exec {RENAMER[1]}>&-
+  wait "$RENAMER_PID" 2>/dev/null
+  RENAMER_OWNER=""
+}
+
+# Move a file like mv, through the renamer of this shell when there is one. Whatever it cannot
+# rename, such as files on another filesystem, is left to mv.
+move_file() {
+  local status
+  if [[ "$RENAMER_OWNER" == "$BASHPID" ]]; then
+    printf '%s\0%s\0' "$1" "$2" >&"${RENAMER[1]}"
+    IFS= read -r status <&"${RENAMER[0]}"
+    [[ "$status" == "0" ]] && return 0
+  fi
+  mv "$1" "$2"
+}
+
+# Encode files by moving every planned source to its encoded name
 encode_files() {
-  while IFS= read -r -d '' file; do
-    # Skip encoding the script file
-    if [[ "$file" != "$SCRIPT_NAME" ]]; then
-      # Encode the file path by replacing characters with their encoded counterparts
-      fullpath=$(readlink -f "$file" | sed -r "s/\//@/g" | sed -r "s/ /_/g" | sed -r "s/§/ /g" | sed -r "s/^\.\///")
-      mv "$file" "$fullpath"  # Rename the file with the encoded file path
+  local source target
+  load_folders "${ROOTS[@]}"
+  set_phase encoding "$(( $(tr -cd '\0' < "$WORK_DIR/plan" | wc -c) / 2 ))"
+  start_renamer
+  while IFS= read -r -d '' source && IFS= read -r -d '' target; do
+    # Rename the file with the encoded file path, then prune the folders it leaves empty
+    if move_file "$source" "$target"; then
+      release_entry "${source%/*}"
+    fi
+    add_progress 1
+  done < "$WORK_DIR/plan"
+  stop_renamer
+}
+
+# Hash the planned files with --hash, JOBS batches at a time
+hash_plan() {
+  : > "$WORK_DIR/updates"
+  (( HASH )) || return 0
+  awk -v RS='\0' -v ORS='\0' 'NR % 2 == 1' "$WORK_DIR/plan" > "$WORK_DIR/plan.sources"
+  load_hash_cache "$WORK_DIR/plan.sources"
+  # Counted as source and target items
+  set_phase hashing "$(tr -cd '\0' < "$WORK_DIR/plan" | wc -c)"
+  run_batches $(( 2 * HASH_BATCH )) hash_batch < "$WORK_DIR/plan"
+}
+
+# Add the entries of this run to the manifest of the current folder
+write_manifest() {
+  local i
+  for i in "${!ROOTS[@]}"; do
+    [[ -f "$WORK_DIR/manifest.$i" ]] && cat "$WORK_DIR/manifest.$i"
+  done > "$WORK_DIR/manifest"
+  apply_updates "$WORK_DIR/manifest"
+  [[ -s "$MANIFEST" ]] || echo "$MANIFEST_HEADER" > "$MANIFEST"
+  cat "$WORK_DIR/manifest" >> "$MANIFEST"
+}
+
+# Add manifest entries for the files of the current folder encoded by the former script, which kept
+# no manifest. Names are parsed in bulk the way it built them from "readlink -f": the root of the
+# encode with "/" as "@" and spaces as "_", then the path below it with "/" as "@" and its spaces
+# kept. Without --strip-root, the root is taken as the folders common to all names; an "_" in it was
+# a space or an underscore, such entries are flagged "ambiguous" and get spaces, or underscores
+# with --keep-underscores.
+import_legacy() {
+  local imported ambiguous skipped
+  [[ -f "$MANIFEST" ]] || echo "$MANIFEST_HEADER" > "$MANIFEST"
+  find . -maxdepth 1 -type f ! -samefile "$SCRIPT_PATH" ! -name '.filinator-*' -printf '%f/%s/%T@\0' > "$WORK_DIR/legacy"
+  awk -F '/' -v OFS='\t' -v root="$STRIP_ROOT" -v keep="$KEEP_UNDERSCORES" \
+      -v manifest="$WORK_DIR/legacy.entries" '
+    function escape(s) {
+      gsub(/\\/, "\\\\\\\\", s)
+      gsub(/\t/, "\\t", s)
+      gsub(/\n/, "\\n", s)
+      return s
+    }
+    function guess(s) {
+      if (!keep) gsub(/_/, " ", s)
+      return s
+    }
+    FNR == 1 { pass++ }
+    pass == 1 { if (!/^#/) { sub(/\t.*/, ""); known[$0] } next }
+    # First pass over the names: the folders common to all of the encoded ones, other files
+    # lying in the folder would make it "/"
+    pass == 2 {
+      if ($1 !~ /^@/) next
+      count = split($1, part, "@")
+      if (!encoded++) { common = count - 1; for (i = 1; i < count; i++) first[i] = part[i] }
+      for (i = 1; i <= common && i < count; i++) if (part[i] != first[i]) break
+      common = i - 1
+      next
+    }
+    FNR == 1 {
+      ambiguous_root = 0
+      if (root != "") {
+        prefix = root
+        gsub(/\//, "@", prefix)
+        gsub(/ /, "_", prefix)
+        sub(/@$/, "", prefix)
+        decoded = root
+      } else {
+        prefix = ""
+        for (i = 1; i <= common; i++) prefix = prefix (i > 1 ? "@" : "") first[i]
+        decoded = guess(prefix)
+        gsub(/@/, "/", decoded)
+        ambiguous_root = prefix ~ /_/
+      }
+      if (decoded == "") decoded = "/"
+    }
+    {
+      name = $1
+      mtime = substr($3, 1, length($3) - 1)
+      if (escape(name) in known) next
+      if (substr(name, 1, length(prefix) + 1) != prefix "@") { skipped++; next }
+      # Below the root, spaces went through "§" and came out as spaces, "_" was an underscore
+      path = substr(name, length(prefix) + 2)
+      gsub(/@/, "/", path)
+      flags = "-"
+      if (ambiguous_root) { flags = "ambiguous"; ambiguous++ }
+      print escape(name), escape(decoded), escape(path), $2, mtime, "-", "-", flags > manifest
+      imported++
+    }
+    END { print imported + 0, ambiguous + 0, skipped + 0 }
+  ' "$MANIFEST" RS='\0' "$WORK_DIR/legacy" "$WORK_DIR/legacy" > "$WORK_DIR/legacy.counts"
+  read -r imported ambiguous skipped < "$WORK_DIR/legacy.counts"
+  [[ -f "$WORK_DIR/legacy.entries" ]] && cat "$WORK_DIR/legacy.entries" >> "$MANIFEST"
+  echo "Imported $imported files into $MANIFEST"
+  (( ambiguous == 0 )) || echo "$ambiguous have an \"_\" that may have been a space, they are flagged ambiguous"
+  if (( skipped > 0 )) && [[ -n "$STRIP_ROOT" ]]; then
+    echo "$skipped files are not below $STRIP_ROOT and were left out"
+  elif (( skipped > 0 )); then
+    echo "$skipped files do not look encoded by the former script and were left out"
+  fi
+}
+
+# Write the Merkle tree of a manifest: the hash of every folder of the backed up paths, "/" being
+# the whole backup, as "hash<TAB>folder" lines. An entry hashes its size, mtime and hash, not how it
+# was sent, so a live tree compares with a backup; a folder hashes the sorted names, kinds and
+# hashes of what it holds.
+write_merkle() {
+  echo "$MERKLE_HEADER"
+  # Without perl the tree is empty, and --compare builds it from the manifest where perl is
+  (( HAVE_PERL )) || return 0
+  perl -MDigest::SHA=sha256_hex -e '
+    my (%children, %depth);
+    while (<STDIN>) {
+      next if /^#/;
+      chomp;
+      my ($name, $root, $path, @fields) = split /\t/, $_, -1;
+      my $full = ($root =~ s{/$}{}r) . "/" . $path;
+      my ($dir, $base) = $full =~ m{^(.*)/([^/]*)$};
+      push @{$children{$dir eq "" ? "/" : $dir}}, "$base\0f\0" . sha256_hex(join "\t", @fields[0, 1, 3]);
+    }
+    # Every folder up to "/" has a hash, even those holding only folders
+    for my $dir (keys %children) {
+      while ($dir ne "/") {
+        $depth{$dir} = ($dir =~ tr{/}{});
+        $dir = $dir =~ m{^(.+)/[^/]*$} ? $1 : "/";
+        $children{$dir} ||= [];
+      }
+    }
+    $depth{"/"} = 0;
+    my %hash;
+    for my $dir (sort { $depth{$b} <=> $depth{$a} } keys %depth) {
+      $hash{$dir} = sha256_hex(join "\n", sort @{$children{$dir}});
+      next if $dir eq "/";
+      my ($parent, $base) = $dir =~ m{^(.*)/([^/]*)$};
+      push @{$children{$parent eq "" ? "/" : $parent}}, "$base\0d\0$hash{$dir}";
+    }
+    print "$hash{$_}\t$_\n" for sort keys %hash;
+  ' < "$1"
+}
+
+# Tell whether $1 is a Merkle tree of the current format, written with perl
+merkle_usable() {
+  [[ -f "$1" && "$(head -n 1 "$1")" == "$MERKLE_HEADER" ]] && grep -q $'\t/$' "$1"
+}
+
+# Keep the entries of the manifest $1 below the absolute folder $2 in the manifest $3
+subtree_manifest() {
+  awk -F '\t' -v root="${2%/}" '
+    BEGIN {
+      gsub(/\\/, "\\\\\\\\", root)
+      gsub(/\t/, "\\t", root)
+      gsub(/\n/, "\\n", root)
+    }
+    /^#/ { print; next }
+    {
+      full = $2
+      sub(/\/$/, "", full)
+      full = full "/" $3
+      if (root == "" || full == root || substr(full, 1, length(root) + 1) == root "/") print
+    }
+  ' "$1" > "$3"
+}
+
+# Write the files of the live tree below the absolute folder $1 to the manifest $2, as --encode
+# would list them, under the folder $4 when given ("" for "/"). Only files with the size and mtime
+# of their entry in the backup manifest $3, which has a hash for them, are hashed, through the hash
+# cache: the others differ anyway.
+live_manifest() {
+  local tree="$1" out="$2" reference="$3" root="${4-${1%/}}"
+  root=${root%/}
+  echo "$MANIFEST_HEADER" > "$out"
+  find "$tree" -type f ! -name '.filinator-*' ! -samefile "$SCRIPT_PATH" -printf '%P\0%s\0%T@\0' |
+    awk -v ORS='\0' -v tree="${tree%/}" -v root="$root" -v out="$out" '
+      function escape(s) {
+        gsub(/\\/, "\\\\\\\\", s)
+        gsub(/\t/, "\\t", s)
+        gsub(/\n/, "\\n", s)
+        return s
+      }
+      FILENAME == ARGV[1] {
+        if (/^#/) next
+        split($0, field, "\t")
+        full = field[2]
+        sub(/\/$/, "", full)
+        if (field[7] != "-") known[full "/" field[3]] = field[4] "\t" field[5]
+        next
+      }
+      FNR % 3 == 1 { path = $0; next }
+      FNR % 3 == 2 { size = $0; next }
+      {
+        # find has one more digit than the manifest
+        mtime = substr($0, 1, length($0) - 1)
+        name = escape(root "/" path)
+        printf "%s\t%s\t%s\t%s\t%s\t-\t-\t-\n", name, escape(root == "" ? "/" : root), escape(path), size, mtime >> out
+        if (known[name] == size "\t" mtime) print tree "/" path
+      }
+    ' "$reference" RS='\0' - > "$WORK_DIR/live.hash"
+  [[ -s "$WORK_DIR/live.hash" ]] || return 0
+  : > "$WORK_DIR/live.hashes"
+  load_hash_cache "$WORK_DIR/live.hash"
+  set_phase hashing "$(tr -cd '\0' < "$WORK_DIR/live.hash" | wc -c)"
+  run_batches "$HASH_BATCH" live_batch < "$WORK_DIR/live.hash"
+  awk -F '\t' -v OFS='\t' -v RS='\0' -v tree="${tree%/}" -v root="$root" '
+    FILENAME == ARGV[1] {
+      name = root substr($0, length($1) + length(tree) + 2)
+      gsub(/\\/, "\\\\\\\\", name)
+      gsub(/\t/, "\\t", name)
+      gsub(/\n/, "\\n", name)
+      hash[name] = $1
+      next
+    }
+    $1 in hash { $7 = hash[$1] }
+    { print }
+  ' "$WORK_DIR/live.hashes" RS='\n' "$out" > "$out.hashed" && mv "$out.hashed" "$out"
+}
+
+# Pair the live tree $1 with the backup manifest $2: the walk of the tree goes to the manifest $3 and
+# the entries of the backup below it to $4. A tree holding nothing of the backup is taken as decoded
+# there, holding the backed up paths from "/" down.
+live_pair() {
+  subtree_manifest "$2" "$1" "$4"
+  if grep -qv '^#' "$4"; then
+    live_manifest "$1" "$3" "$4"
+  else
+    cp "$2" "$4"
+    live_manifest "$1" "$3" "$4" ""
+  fi
+}
+
+# Hash a batch of live files for live_manifest, appending "hash<TAB>name" records to WORK_DIR/live.hashes
+live_batch() {
+  local name
+  local -A identities=() hashes=()
+  snapshot_files identities "$@"
+  hash_files hashes identities "$@"
+  for name in "$@"; do
+    # One short write per record keeps the records of parallel workers whole
+    [[ -n "${hashes[$name]}" ]] && printf '%s\t%s\0' "${hashes[$name]}" "$name" >> "$WORK_DIR/live.hashes"
+  done
+}
+
+# Compare the backup of the current folder with another one: a folder, a manifest or a host.
+# Their Merkle trees first tell whether they match at all. A folder without a manifest, the
+# current one included, is a live tree: it is walked and compared with the part of the backup
+# below it.
+compare_backups() {
+  local other="$1" mine="$WORK_DIR/merkle.mine" theirs="$WORK_DIR/merkle.theirs" manifest dir="$WORK_DIR/compare" live=""
+  mkdir -p "$dir"
+  [[ -f "$MANIFEST" ]] || live=$(pwd -P)
+  if [[ "$other" != *://* && -d "$other" && ! -f "$other/$MANIFEST" ]]; then
+    if [[ -n "$live" ]]; then
+      echo "Neither the current folder nor $other has a $MANIFEST, there is no backup to compare"
+      exit 1
+    fi
+    live_pair "$(readlink -f "$other")" "$MANIFEST" "$dir/there" "$dir/here"
+    diff_manifests "$dir/here" "$dir/there"
+    return
+  fi
+
+  if [[ "$other" == *://* ]]; then
+    : > "$WORK_DIR/failed"
+    declare -gA ENTRY_MTIME=()
+    FETCH_SOURCE=${other%/}
+    manifest="$dir/$MANIFEST"
+  elif [[ -d "$other" ]]; then
+    manifest="$other/$MANIFEST"
+  else
+    manifest="$other"
+  fi
+  if [[ -n "$live" ]]; then
+    [[ "$other" != *://* ]] || fetch_batch "$dir" "$MANIFEST" > /dev/null
+    if [[ ! -f "$manifest" ]]; then
+      echo "No manifest found in $other"
+      exit 1
     fi
-  done < <(find . -type f -print0)
+    live_pair "$live" "$manifest" "$dir/here" "$dir/there"
+    diff_manifests "$dir/here" "$dir/there"
+    return
+  fi
+
+  if merkle_usable "$MERKLE" && [[ "$MERKLE" -nt "$MANIFEST" ]]; then
+    cp "$MERKLE" "$mine"
+  else
+    write_merkle "$MANIFEST" > "$mine"
+  fi
+  if [[ "$other" == *://* ]]; then
+    # The tree of the host is enough to find out that nothing differs
+    fetch_batch "$dir" "$MERKLE" > /dev/null
+    merkle_usable "$dir/$MERKLE" && cp "$dir/$MERKLE" "$theirs"
+  elif [[ -d "$other" ]]; then
+    merkle_usable "$other/$MERKLE" && [[ "$other/$MERKLE" -nt "$manifest" ]] && cp "$other/$MERKLE" "$theirs"
+  fi
+  if [[ ! -s "$theirs" || "$(awk -F '\t' '$2 == "/"' "$mine")" != "$(awk -F '\t' '$2 == "/"' "$theirs")" ]]; then
+    [[ "$other" != *://* ]] || fetch_batch "$dir" "$MANIFEST" > /dev/null
+    if [[ ! -f "$manifest" ]]; then
+      echo "No manifest found in $other"
+      exit 1
+    fi
+    [[ -s "$theirs" ]] || write_merkle "$manifest" > "$theirs"
+  fi
+  diff_manifests "$MANIFEST" "$manifest" "$mine" "$theirs"
+}
+
+# Print what differs between the manifests $1, here, and $2, there, descending from "/" into the
+# folders whose hashes differ in their Merkle trees $3 and $4, written when not given: "+ path" for
+# what only is there, "- path" for what only is here and "~ path" for entries that differ.
+diff_manifests() {
+  local mine="${3:-$WORK_DIR/merkle.mine}" theirs="${4:-$WORK_DIR/merkle.theirs}"
+  [[ -n "$3" ]] || write_merkle "$1" > "$mine"
+  [[ -n "$4" ]] || write_merkle "$2" > "$theirs"
+  perl -e '
+    my ($mine, $manifest, $theirs, $other) = @ARGV;
+    sub tree {
+      my %hash;
+      open(my $file, "<", shift) or return {};
+      while (<$file>) {
+        next if /^#/;
+        chomp;
+        my ($hash, $dir) = split /\t/, $_, 2;
+        $hash{$dir} = $hash;
+      }
+      return \%hash;
+    }
+    my ($a, $b) = (tree($mine), tree($theirs));
+    exit 0 if defined $a->{"/"} && defined $b->{"/"} && $a->{"/"} eq $b->{"/"};
+    # Descend from "/" into the folders whose hashes differ
+    my (%below, %differ);
+    for my $dir (keys %$a, keys %$b) {
+      next if $dir eq "/";
+      $below{$dir =~ m{^(.+)/[^/]*$} ? $1 : "/"}{$dir} = 1;
+    }
+    my @queue = ("/");
+    while (defined(my $dir = shift @queue)) {
+      next if defined $a->{$dir} && defined $b->{$dir} && $a->{$dir} eq $b->{$dir};
+      $differ{$dir} = 1;
+      push @queue, keys %{$below{$dir} || {}};
+    }
+    sub entries {
+      my %entries;
+      open(my $file, "<", shift) or return {};
+      while (<$file>) {
+        next if /^#/;
+        chomp;
+        my ($name, $root, $path, @fields) = split /\t/, $_, -1;
+        my $full = ($root =~ s{/$}{}r) . "/" . $path;
+        my ($dir) = $full =~ m{^(.*)/};
+        $entries{$full} = join "\t", @fields[0, 1, 3] if $differ{$dir eq "" ? "/" : $dir};
+      }
+      return \%entries;
+    }
+    my ($here, $there) = (entries($manifest), entries($other));
+    for my $path (sort keys %{{ %$here, %$there }}) {
+      if (!defined $here->{$path}) { print "+ $path\n" }
+      elsif (!defined $there->{$path}) { print "- $path\n" }
+      elsif ($here->{$path} ne $there->{$path}) { print "~ $path\n" }
+    }
+    exit 1;
+  ' "$mine" "$1" "$theirs" "$2" && echo "Both backups are identical"
 }
 
-# Find and remove empty folders
-find_empty_folders() {
-  find . -depth -type d -empty -exec rmdir {} \;
+# Rename an existing file aside as "name.~N~", the numbered backups of mv
+rename_aside() {
+  local n=1
+  while [[ -e "$1.~$n~" || -L "$1.~$n~" ]]; do
+    (( n++ ))
+  done
+  move_file "$1" "$1.~$n~"
 }
 
-# Decode files by restoring characters in the file path
+# Decide what to do with a decoded file whose target already exists, following ON_CONFLICT.
+# Files with the same size and mtime are identical, their content is only compared
+# with --compare-content. The decision is stored in ACTION: replace, backup, drop or keep.
+resolve_conflict() {
+  local file="$1" filename="$2" size="$3" mtime="$4" existing_size existing_mtime identical=0
+  if [[ "$ON_CONFLICT" == "overwrite" ]]; then
+    ACTION=replace
+    return
+  fi
+  read -r existing_size existing_mtime < <(stat -L -c '%s %Y' "$filename" 2>/dev/null)
+  if [[ "$existing_size" == "$size" && "$existing_mtime" == "$mtime" ]]; then
+    identical=1
+    # Compacted sparse files cannot be compared byte for byte before they are expanded
+    if (( COMPARE_CONTENT )) && [[ "$(stat -c %s "$file")" == "$size" ]]; then
+      cmp -s "$file" "$filename" || identical=0
+    fi
+  fi
+
+  if (( identical )); then
+    ACTION=drop
+    return
+  fi
+  case $ON_CONFLICT in
+    skip-identical) ACTION=replace ;;
+    keep-newer) (( mtime > existing_mtime )) && ACTION=replace || ACTION=keep ;;
+    rename) ACTION=backup ;;
+    fail)
+      echo "Decoding aborted, $filename already exists with a different content"
+      exit 1
+      ;;
+  esac
+}
+
+# Move a decoded file into place, restoring the holes of sparse files and the mtime from the manifest
+# entry, named after the file unless given. Returns 1 when the file cannot be restored, and 2 when
+# it stays encoded on purpose, next to a newer one.
+restore_file() {
+  local file="$1" filename="$2" name="${3:-${1#./}}" size blocks disk_mtime mtime chain=()
+  decompress_file "$file" "$name" "$DELTA_DIR" || return 1
+  # Files sent with --delta are their first upload followed by the changed blocks of each later one
+  # A file decoded where it was encoded is already current, like its manifest entry
+  if [[ ",${ENTRY_FLAGS[$name]}," =~ ,delta=([0-9]+), ]] &&
+     [[ "$DELTA_DIR" != "." || "$(stat -c '%s %.9Y' "$file")" != "${ENTRY_SIZE[$name]} ${ENTRY_MTIME[$name]}" ]]; then
+    apply_deltas "$file" "$name" "${BASH_REMATCH[1]}" "$DELTA_DIR" || return 1
+    # Decoding consumes the deltas once the file is in place, fetched ones stay in the cache
+    [[ "$DELTA_DIR" == "." ]] && chain=("${DELTA_CHAIN[@]}")
+  fi
+  read -r size blocks disk_mtime < <(stat -c '%s %b %.9Y' "$file")
+  mtime=${ENTRY_MTIME[$name]:-$disk_mtime}
+  if [[ ",${ENTRY_FLAGS[$name]}," == *,changed,* ]]; then
+    echo "Warning: $filename was changing while it was backed up, it may be inconsistent"
+  fi
+
+  if [[ -e "$filename" || -L "$filename" ]]; then
+    resolve_conflict "$file" "$filename" "${SPARSE_SIZE[$name]:-$size}" "${mtime%.*}"
+    case $ACTION in
+      drop)
+        (( CONFLICTS_SKIPPED++ ))
+        rm "$file"
+        (( ${#chain[@]} == 0 )) || rm -f "${chain[@]}"
+        return 0
+        ;;
+      keep)
+        (( CONFLICTS_KEPT++ ))
+        echo "Kept the newer $filename, $file was left encoded"
+        return 2
+        ;;
+      backup)
+        (( CONFLICTS_RENAMED++ ))
+        rename_aside "$filename" || return 1
+        ;;
+    esac
+  fi
+
+  if [[ -z "${SPARSE_EXTENTS[$name]}" ]]; then
+    move_file "$file" "$filename" || return 1
+  elif (( size == SPARSE_SIZE[$name] )); then
+    # Either still the original sparse file, or downloaded with its zeros written out
+    (( blocks * 512 < size )) || punch_holes "$file" "$size" "${SPARSE_EXTENTS[$name]}"
+    move_file "$file" "$filename" || return 1
+  else
+    # Uploaded without its holes, put the data back at its offsets
+    expand_sparse "$file" "$filename" "${SPARSE_SIZE[$name]}" "${SPARSE_EXTENTS[$name]}" && rm "$file" || return 1
+    disk_mtime=""
+  fi
+  (( ${#chain[@]} == 0 )) || rm -f "${chain[@]}"
+  # Downloads get the time of the transfer, put the original one back
+  if [[ -n "${ENTRY_MTIME[$name]}" && "$mtime" != "$disk_mtime" ]]; then
+    touch -m -d "@$mtime" "$filename"
+  fi
+}
+
+# Decode files by restoring characters in the file path. Returns 1 when some could not be restored.
 decode_files() {
-  while IFS= read -r -d '' file; do
-    # Skip decoding the script file
-    if [[ "$file" != "$SCRIPT_NAME" ]]; then
-      # Decode the file path by replacing encoded characters with their original counterparts
-      filename=$(echo "$file" | sed -r "s/@/\//g" | sed -r "s/^\.\///" | sed -r "s/§/ /g" | sed -r "s/_/ /g" | sed -r "s/^\///")
-      mkdir -p "$(dirname "$filename")"  # Create the directory structure for the decoded file path
-      mv "$file" "$filename"  # Rename the file with the decoded file path
+  local type file dir created name original files=0 failed=0
+  local -A children=()
+  declare -gA LEGACY_DIRS=()
+  load_manifest all
+  CONFLICTS_SKIPPED=0 CONFLICTS_KEPT=0 CONFLICTS_RENAMED=0
+  # Twins were sent once, under the name of another file with the same content: copy it for them
+  for name in "${!ENTRY_FLAGS[@]}"; do
+    [[ ",${ENTRY_FLAGS[$name]}," == *,same,* && ! -e "$name" && ! -e "${ENTRY_PATH[$name]#/}" ]] || continue
+    original=${ENTRY_BY_HASH[${ENTRY_HASH[$name]}]}
+    if [[ -z "$original" || ! -f "$original" ]] || ! cp --reflink=auto "$original" "$name"; then
+      echo "Cannot restore ${ENTRY_PATH[$name]}, ${original:-the file with the same content} is missing"
+      (( failed++ ))
+    fi
+  done
+  # Count the entries of the folders while listing the files, for the pruning
+  find . -mindepth 1 -printf '%y\0%p\0' > "$WORK_DIR/decode"
+  while IFS= read -r -d '' type && IFS= read -r -d '' file; do
+    children[${file%/*}]=$(( ${children[${file%/*}]:-0} + 1 ))
+    [[ "$type" == "d" ]] && children[$file]=${children[$file]:-0}
+    [[ "$type" == "f" ]] && (( files++ ))
+  done < "$WORK_DIR/decode"
+  for dir in "${!children[@]}"; do
+    printf '%s\0%s\0' "$dir" "${children[$dir]}"
+  done > "$WORK_DIR/folders.decode"
+  load_folders "."
+  set_phase decoding "$files"
+  start_renamer
+
+  while IFS= read -r -d '' type && IFS= read -r -d '' file; do
+    # Skip decoding folders, the script file and our own bookkeeping
+    if [[ "$type" == "f" && "$file" != "$SCRIPT_NAME" && "$file" != ./.filinator-* ]]; then
+      # The manifest knows the original path, other names are decoded by replacing encoded characters
+      if [[ -n "${ENTRY_PATH[${file#./}]}" ]]; then
+        filename=${ENTRY_PATH[${file#./}]#/}
+      else
+        filename=$(echo "$file" | sed -r "s/@/\//g" | sed -r "s/^\.\///" | sed -r "s/§/ /g" | sed -r "s/_/ /g" | sed -r "s/^\///")
+        # Only the folders made for such files are left to decode_folders
+        dir=$filename
+        created=""
+        while [[ "$dir" == */* ]]; do
+          dir=${dir%/*}
+          [[ -d "$dir" ]] && break
+          created=$dir
+        done
+        [[ -n "$created" ]] && LEGACY_DIRS[$created]=1
+      fi
+      # Already decoded by an earlier run
+      [[ "$filename" == "${file#./}" ]] && continue
+      # Create the directory structure for the decoded file path
+      [[ "$filename" != */* || -d "${filename%/*}" ]] || mkdir -p "${filename%/*}"
+      # Rename the file with the decoded file path, then prune the folders it leaves empty
+      restore_file "$file" "$filename"
+      case $? in
+        0) release_entry "${file%/*}" ;;
+        1) (( failed++ )) ;;
+      esac
+      add_progress 1
     fi
-  done < <(find . -type f -print0)
+  done < "$WORK_DIR/decode"
+  stop_renamer
+
+  if (( CONFLICTS_SKIPPED + CONFLICTS_KEPT + CONFLICTS_RENAMED > 0 )); then
+    echo "Existing files: $CONFLICTS_SKIPPED identical skipped, $CONFLICTS_KEPT newer kept, $CONFLICTS_RENAMED renamed aside"
+  fi
+  if (( failed > 0 )); then
+    echo "$failed files could not be decoded"
+    return 1
+  fi
 }
 
-# Decode folders by replacing "§" with spaces
+# Decode the folders made for files without a manifest entry, listed in LEGACY_DIRS, by replacing
+# "§" with spaces. Paths from the manifest are exact, and an existing name is never replaced.
 decode_folders() {
-  find . -depth -name "*§*" -execdir bash -c 'mv "$1" "${1//§/ }"' _ {} \;
+  (( ${#LEGACY_DIRS[@]} > 0 )) || return 0
+  find "${!LEGACY_DIRS[@]}" -depth -name "*§*" -execdir bash -c '
+    name=${1#./}
+    if [[ -e "${name//§/ }" || -L "${name//§/ }" ]]; then
+      echo "Kept $name, ${name//§/ } already exists"
+    else
+      mv "$name" "${name//§/ }"
+    fi
+  ' _ {} \;
+}
+
+# Write the planned files to STREAM as pax archives instead of renaming them. With --stream-index
+# or --volume-size, every archive ends with an index member closed by a 512 byte footer block
+# "filinator-index <offset of the index member> <length> <volume> <volumes>", so each volume
+# can be listed and restored on its own.
+stream_encode() {
+  local dest="$STREAM" volumes status
+  [[ "$dest" == "-" ]] && dest="/dev/fd/$STREAM_FD"
+  # Archive members are the absolute paths without their leading "/", as decode restores them
+  awk -v RS='\0' -v ORS='\0' 'NR % 2 == 1 { print substr($0, 2) }' "$WORK_DIR/plan" > "$WORK_DIR/stream.list"
+  if (( !STREAM_INDEX && !VOLUME_SIZE )); then
+    stream_snapshot "$WORK_DIR/stream.list" > "$WORK_DIR/stream.before"
+    tar --format=pax --sparse -C / --null --no-recursion -T "$WORK_DIR/stream.list" -cf "$dest"
+    status=$?
+    # Without an index there is nowhere to flag the files that changed while read, only tell
+    stream_snapshot "$WORK_DIR/stream.list" > "$WORK_DIR/stream.after"
+    changed_members "$WORK_DIR/stream" | while IFS= read -r -d '' name; do
+      echo "Archived /$name while it was still changing" >&2
+    done
+    # Status 1 is such a file, anything else a failure
+    (( status <= 1 ))
+    return
+  fi
+
+  # Take the sizes from the manifest entries, by the encoded names of the plan
+  awk -F '\t' -v ORS='\0' '
+    RS == "\n" { size[$1] = $4; next }
+    FNR % 2 == 0 {
+      gsub(/\\/, "\\\\\\\\")
+      gsub(/\t/, "\\t")
+      gsub(/\n/, "\\n")
+      print size[$0]
+    }
+  ' "$WORK_DIR"/manifest.* RS='\0' "$WORK_DIR/plan" > "$WORK_DIR/stream.sizes"
+  # Fill volumes up to the size, counting the headers, a larger file gets a volume of its own
+  volumes=$(awk -v RS='\0' -v ORS='\0' -v limit="$VOLUME_SIZE" -v out="$WORK_DIR/stream.list." '
+    FILENAME == ARGV[1] { size[FNR] = $0; next }
+    {
+      if (limit > 0 && used > 0 && used + size[FNR] > limit) { volume++; used = 0 }
+      used += size[FNR] + 1536
+      print > (out volume + 1)
+      print size[FNR] > (out volume + 1 ".sizes")
+    }
+    END { printf "%d", volume + 1 }
+  ' "$WORK_DIR/stream.sizes" "$WORK_DIR/stream.list")
+  if (( volumes == 1 )); then
+    write_volume "$dest" 1 1
+    return
+  fi
+  set_phase "writing volumes" "$volumes"
+  printf '%s\0' $(seq 1 "$volumes") | run_batches 1 volume_batch "$dest" "$volumes"
+  echo "Wrote $volumes volumes $dest.$(printf '%03d' 1) to $dest.$(printf '%03d' "$volumes")"
+}
+
+# Print "size mtime ctime /member" of the members listed in the NUL separated file $1, NUL separated
+stream_snapshot() {
+  sed -z 's|^|/|' "$1" | xargs -0 -r stat --printf '%s %.9Y %.9Z %n\0' -- 2>/dev/null
+}
+
+# Print the members whose snapshot in $1.after differs from $1.before, NUL separated
+changed_members() {
+  awk -v RS='\0' -v ORS='\0' '
+    FILENAME == ARGV[1] { before[$0]; next }
+    !($0 in before) { sub(/^[^ ]* [^ ]* [^ ]* \//, ""); print }
+  ' "$1.before" "$1.after"
+}
+
+# Write one numbered volume of a volume set, for run_batches
+volume_batch() {
+  write_volume "$1.$(printf '%03d' "$3")" "$3" "$2"
+}
+
+# Write the members of WORK_DIR/stream.list.VOLUME to DEST, followed by their index:
+# "offset<TAB>size<TAB>hash<TAB>flags<TAB>name" per member, the hash being "-" without --hash
+# and the flags "changed" for a file that changed while it was read, "-" otherwise
+write_volume() {
+  local dest="$1" volume="$2" volumes="$3" list="$WORK_DIR/stream.list.$2" offsets=() sizes=() i bytes offset name record status
+  local -A hashes=() changed=()
+  stream_snapshot "$list" > "$list.before"
+  # One block records make the end of archive exactly two blocks, cut so the index can follow
+  {
+    tar --format=pax --sparse -b 1 -C / --null --no-recursion -T "$list" \
+      -cvR --index-file="$list.blocks" -f - | head -c -1024 | tee /dev/fd/4 | wc -c > "$list.bytes"
+    status=${PIPESTATUS[0]}
+  } 4> "$dest"
+  mapfile -t offsets < <(sed -n 's/^block \([0-9]*\): .*/\1/p' "$list.blocks")
+  mapfile -t -d '' sizes < "$list.sizes"
+  # Status 1 is a file that changed while read, anything else a file torn or left out
+  if (( status > 1 || ${#offsets[@]} != $(tr -cd '\0' < "$list" | wc -c) )); then
+    echo "Some files could not be archived, $dest has no index" >&2
+    head -c 1024 /dev/zero >> "$dest"
+    return 1
+  fi
+  stream_snapshot "$list" > "$list.after"
+  while IFS= read -r -d '' name; do
+    echo "Archived /$name while it was still changing" >&2
+    changed[$name]=changed
+  done < <(changed_members "$list")
+  if (( HASH )); then
+    while IFS= read -r -d '' record; do
+      hashes[${record:67}]="sha256:${record:0:64}"
+    done < <(sed -z 's|^|/|' "$list" | xargs -0 sha256sum -z -- 2>/dev/null)
+  fi
+
+  # tar lists the members in the order of the list, pair them up
+  i=0
+  while IFS= read -r -d '' name; do
+    manifest_escape "$name"
+    printf '%s\t%s\t%s\t%s\t%s\n' $(( offsets[i] * 512 )) "${sizes[i]}" "${hashes[$name]:--}" "${changed[$name]:--}" "$ESCAPED"
+    (( i++ ))
+  done < "$list" > "$list.index"
+  bytes=$(stat -c %s "$list.index")
+  offset=$(< "$list.bytes")
+  # Pad to a block so the footer is the last block of the member, right before the end of archive
+  head -c $(( (512 - bytes % 512) % 512 )) /dev/zero | tr '\0' '\n' >> "$list.index"
+  printf '%-511s\n' "filinator-index $offset $bytes $volume $volumes flags" >> "$list.index"
+  tar --format=pax -b 1 -C "$WORK_DIR" --transform="s|.*|$INDEX_NAME|" -cf - "${list##*/}.index" >> "$dest"
+}
+
+# Read the index of a stream file into STREAM_OFFSETS, STREAM_SIZES, STREAM_HASHES, STREAM_FLAGS and STREAM_NAMES,
+# the offsets ending with the one of the index member itself, and its place in the volume set into
+# STREAM_VOLUME and STREAM_VOLUMES. Fails when the stream has no index.
+read_stream_index() {
+  local source="$1" magic index_offset bytes format offset size hash flags name
+  [[ -f "$source" ]] || return 1
+  read -r magic index_offset bytes STREAM_VOLUME STREAM_VOLUMES format < <(tail -c 1536 "$source" | head -c 512)
+  [[ "$magic" == "filinator-index" ]] || return 1
+  STREAM_OFFSETS=()
+  STREAM_SIZES=()
+  STREAM_HASHES=()
+  STREAM_FLAGS=()
+  STREAM_NAMES=()
+  while IFS=$'\t' read -r offset size hash name; do
+    flags=-
+    # Streams written before volumes only had offsets and names, and before flags no flags
+    if [[ -z "$STREAM_VOLUME" ]]; then
+      name=$size size=- hash=-
+    elif [[ "$format" == "flags" ]]; then
+      flags=${name%%$'\t'*}
+      name=${name#*$'\t'}
+    fi
+    printf -v name '%b' "$name"
+    STREAM_OFFSETS+=("$offset")
+    STREAM_SIZES+=("$size")
+    STREAM_HASHES+=("$hash")
+    STREAM_FLAGS+=("${flags:--}")
+    STREAM_NAMES+=("$name")
+  done < <(tail -c "+$(( index_offset + 1 ))" "$source" | tar -xOf - "$INDEX_NAME" | head -c "$bytes")
+  STREAM_OFFSETS+=("$index_offset")
+  : "${STREAM_VOLUME:=1}" "${STREAM_VOLUMES:=1}"
+}
+
+# Find the files of a stream: the file itself, or the numbered volumes of a volume set
+stream_volumes() {
+  local volume
+  VOLUMES=()
+  if [[ "$1" == "-" || -e "$1" ]]; then
+    VOLUMES=("$1")
+  else
+    for volume in "$1".[0-9][0-9][0-9]; do
+      [[ -f "$volume" ]] && VOLUMES+=("$volume")
+    done
+  fi
+  if (( ${#VOLUMES[@]} == 0 )); then
+    echo "No stream or volumes found for $1"
+    exit 1
+  fi
+  # Every volume knows the size of its set, report the missing ones but restore the others
+  if (( ${#VOLUMES[@]} > 1 )) && read_stream_index "${VOLUMES[0]}" && (( STREAM_VOLUMES != ${#VOLUMES[@]} )); then
+    echo "Found ${#VOLUMES[@]} of the $STREAM_VOLUMES volumes of $1"
+  fi
+}
+
+# Restore the streams written by --to-stream, the volumes of a set in parallel
+stream_decode() {
+  stream_volumes "$FROM_STREAM"
+  if (( ${#VOLUMES[@]} == 1 )); then
+    decode_volume "${VOLUMES[0]}"
+    return
+  fi
+  set_phase "restoring volumes" "${#VOLUMES[@]}"
+  printf '%s\0' "${VOLUMES[@]}" | run_batches 1 decode_volume
+}
+
+# Restore one stream file. Named paths are read straight from their offsets when the stream
+# has an index, the whole archive is read otherwise.
+decode_volume() {
+  local source="$1" path i length options=(--exclude="$INDEX_NAME")
+  [[ "$source" == "-" ]] && source="/dev/stdin"
+  case $ON_CONFLICT in
+    keep-newer) options+=(--keep-newer-files) ;;
+    rename) options+=(--backup=numbered) ;;
+    fail) options+=(--keep-old-files) ;;
+  esac
+  if (( ${#OPERANDS[@]} == 0 )); then
+    tar -xf "$source" "${options[@]}" || return
+    if [[ "$source" != "/dev/stdin" ]] && read_stream_index "$source"; then
+      for i in "${!STREAM_NAMES[@]}"; do
+        [[ "${STREAM_FLAGS[i]}" == "changed" ]] &&
+          echo "Warning: /${STREAM_NAMES[i]} was changing while it was backed up, it may be inconsistent"
+      done
+    fi
+    return 0
+  fi
+  if ! read_stream_index "$source"; then
+    # Paths missing from one volume of a set are expected
+    tar -xf "$source" "${options[@]}" -- "${OPERANDS[@]#/}" 2>/dev/null
+    return
+  fi
+
+  for path in "${OPERANDS[@]}"; do
+    path=${path#/}
+    path=${path%/}
+    for i in "${!STREAM_NAMES[@]}"; do
+      [[ "${STREAM_NAMES[i]}" == "$path" || "${STREAM_NAMES[i]}" == "$path"/* ]] || continue
+      [[ "${STREAM_FLAGS[i]}" == "changed" ]] &&
+        echo "Warning: /${STREAM_NAMES[i]} was changing while it was backed up, it may be inconsistent"
+      # A member runs until the next one, the end of archive makes the slice a valid archive
+      length=$(( STREAM_OFFSETS[i + 1] - STREAM_OFFSETS[i] ))
+      { tail -c "+$(( STREAM_OFFSETS[i] + 1 ))" "$source" | head -c "$length"; head -c 1024 /dev/zero; } |
+        tar -xf - "${options[@]}"
+    done
+  done
+}
+
+# List the files of streams from their indexes, or from the whole archive when they have none
+list_streams() {
+  local stream volume i
+  for stream in "$@"; do
+    stream_volumes "$stream"
+    for volume in "${VOLUMES[@]}"; do
+      if ! read_stream_index "$volume"; then
+        tar -tvf "$volume"
+        continue
+      fi
+      echo "# $volume: volume $STREAM_VOLUME of $STREAM_VOLUMES, ${#STREAM_NAMES[@]} files"
+      for i in "${!STREAM_NAMES[@]}"; do
+        printf '%s\t%s\t%s\t%s\n' "${STREAM_SIZES[i]}" "${STREAM_HASHES[i]}" "${STREAM_FLAGS[i]}" "/${STREAM_NAMES[i]}"
+      done
+    done
+  done
+}
+
+# Percent-encode a name for use in an URL, the result is stored in URL_NAME
+url_encode() {
+  local LC_ALL=C name="$1" char i
+  URL_NAME=""
+  for (( i = 0; i < ${#name}; i++ )); do
+    char=${name:i:1}
+    case $char in
+      [a-zA-Z0-9._~-]) URL_NAME+="$char" ;;
+      *) printf -v char '%%%02X' "'$char"; URL_NAME+="$char" ;;
+    esac
+  done
+}
+
+# Sleep for a number of milliseconds
+sleep_ms() {
+  (( $1 > 0 )) && sleep "$(( $1 / 1000 )).$(printf '%03d' $(( $1 % 1000 )))"
+}
+
+# Current time in milliseconds, stored in NOW_MS
+now_ms() {
+  local micro=${EPOCHREALTIME//[!0-9]/}
+  NOW_MS=$(( 10#$micro / 1000 ))
+}
+
+# Store a file on the local mock host, behaving like a slow and unreliable server.
+# Sets MOCK_CODE to the response code and returns the exit status curl would have returned.
+mock_upload() {
+  local flavor="$1" dir="$2" file="$3" name="$4" size requests lower owner
+  size=$(stat -c %s "$file")
+  # SFTP needs an open, a write and a close round trip, HTTP a single request
+  [[ "$flavor" == "sftp" ]] && requests=3 || requests=1
+  sleep_ms $(( MOCK_LATENCY_MS * requests + MOCK_OVERHEAD_MS ))
+
+  if (( MOCK_FAILURE_RATE > 0 && RANDOM % 100 < MOCK_FAILURE_RATE )); then
+    echo "mock-$flavor: injected failure for $name" >&2
+    [[ "$flavor" == "http" ]] && { MOCK_CODE=503; return 0; }
+    MOCK_CODE=000
+    return 55
+  fi
+  if (( MOCK_MAX_SIZE > 0 && size > MOCK_MAX_SIZE )); then
+    echo "mock-$flavor: $name is larger than $MOCK_MAX_SIZE bytes" >&2
+    [[ "$flavor" == "http" ]] && { MOCK_CODE=413; return 0; }
+    MOCK_CODE=552
+    return 25
+  fi
+  if (( MOCK_CASE_INSENSITIVE )); then
+    # Claim the folded name once, a different spelling would overwrite another file
+    lower=${name,,}
+    mkdir -p "$dir/.names"
+    if ! ln -s "$name" "$dir/.names/$lower" 2>/dev/null; then
+      owner=$(readlink "$dir/.names/$lower")
+      if [[ "$owner" != "$name" ]]; then
+        echo "mock-$flavor: $name collides with $owner on a case insensitive host" >&2
+        [[ "$flavor" == "http" ]] && { MOCK_CODE=409; return 0; }
+        MOCK_CODE=553
+        return 25
+      fi
+    fi
+  fi
+  if (( MOCK_BANDWIDTH > 0 )); then
+    sleep_ms $(( size * 1000 / MOCK_BANDWIDTH ))
+  fi
+
+  # Write under a temporary name so an interrupted transfer never looks complete
+  if ! cp "$file" "$dir/.partial.$BASHPID" || ! mv "$dir/.partial.$BASHPID" "$dir/$name"; then
+    MOCK_CODE=000
+    return 23
+  fi
+  [[ "$flavor" == "http" ]] && MOCK_CODE=201 || MOCK_CODE=226
+}
+
+# Serve the mock-http:// folder $1 over real HTTP on a free local port, written to the file $2,
+# so uploads go through the curl multipart branch: keep-alive requests, Content-Length or chunked
+# bodies, form fields decoded as browsers encode them. The mock latency, overhead, bandwidth, size
+# limit, failure rate and case folding apply; it stops with the run that started it.
+mock_http_server() {
+  (( MOCK_CASE_INSENSITIVE )) && mkdir -p "$1/.names"
+  perl -MIO::Socket::INET -MTime::HiRes=sleep -e '
+    my ($dir, $port_file, $field, $latency, $overhead, $bandwidth, $max, $rate, $seed, $folding, $parent) = @ARGV;
+    my $server = IO::Socket::INET->new(LocalAddr => "127.0.0.1", LocalPort => 0, Listen => 64,
+                                       ReuseAddr => 1, Timeout => 1) or die "mock-http: $!\n";
+    open(my $out, ">", "$port_file.new") or die;
+    print $out $server->sockport, "\n";
+    close $out;
+    rename "$port_file.new", $port_file;
+    $SIG{CHLD} = "IGNORE";
+    my $connections = 0;
+    while (kill 0, $parent) {
+      my $client = $server->accept or next;
+      $connections++;
+      if (fork) { close $client; next }
+      close $server;
+      srand($seed eq "" ? time ^ $$ : $seed + $connections);
+      serve($client);
+      exit 0;
+    }
+
+    sub reply {
+      my ($client, $code, $text) = @_;
+      print $client "HTTP/1.1 $code $text\r\nContent-Length: 0\r\n\r\n";
+    }
+
+    sub serve {
+      my $client = shift;
+      binmode $client;
+      $client->autoflush(1);
+      while (defined(my $line = <$client>)) {
+        next if $line =~ /^\r?\n$/;
+        my %header;
+        while (defined(my $header = <$client>)) {
+          last if $header =~ /^\r?\n$/;
+          $header{lc $1} = $2 if $header =~ /^([^:]+):\s*(.*?)\r?\n$/;
+        }
+        my $body = "";
+        if (($header{"transfer-encoding"} // "") =~ /chunked/i) {
+          while (defined(my $size = <$client>)) {
+            $size = hex $size;
+            if ($size == 0) {
+              while (defined(my $trailer = <$client>)) { last if $trailer =~ /^\r?\n$/ }
+              last;
+            }
+            read($client, my $chunk, $size);
+            $body .= $chunk;
+            <$client>;
+          }
+        } else {
+          read($client, $body, $header{"content-length"} // 0);
+        }
+        sleep(($latency + $overhead) / 1000);
+
+        my ($boundary) = ($header{"content-type"} // "") =~ /boundary="?([^";]+)/;
+        my ($name, $data);
+        for my $part (defined $boundary ? split /\r\n--\Q$boundary\E/, "\r\n$body" : ()) {
+          my ($head, $content) = split /\r\n\r\n/, $part, 2;
+          next unless defined $content && $head =~ /name="\Q$field\E"; filename="([^"]*)"/;
+          ($name, $data) = ($1, $content);
+          $data =~ s/\r\n$//;
+          $name =~ s/%(22|0A|0D)/chr hex $1/ge;
+        }
+        if (!defined $name || $name eq "" || $name =~ m{/}) {
+          reply($client, 400, "Bad Request");
+        } elsif ($rate > 0 && rand(100) < $rate) {
+          print STDERR "mock-http: injected failure for $name\n";
+          reply($client, 503, "Service Unavailable");
+        } elsif ($max > 0 && length($data) > $max) {
+          print STDERR "mock-http: $name is larger than $max bytes\n";
+          reply($client, 413, "Payload Too Large");
+        } elsif ($folding && !symlink($name, "$dir/.names/" . lc $name)
+                 && (my $owner = readlink("$dir/.names/" . lc $name)) ne $name) {
+          print STDERR "mock-http: $name collides with $owner on a case insensitive host\n";
+          reply($client, 409, "Conflict");
+        } else {
+          sleep(length($data) / $bandwidth) if $bandwidth > 0;
+          # Written under a temporary name so an interrupted transfer never looks complete
+          open(my $file, ">", "$dir/.partial.$$") or do { reply($client, 500, "Internal Server Error"); next };
+          binmode $file;
+          print $file $data;
+          close $file;
+          rename "$dir/.partial.$$", "$dir/$name";
+          reply($client, 201, "Created");
+        }
+        last if ($header{"connection"} // "") =~ /close/i;
+      }
+    }
+  ' "$1" "$2" "$HTTP_FIELD" "$MOCK_LATENCY_MS" "$MOCK_OVERHEAD_MS" "$MOCK_BANDWIDTH" "$MOCK_MAX_SIZE" \
+    "$MOCK_FAILURE_RATE" "$MOCK_SEED" "$MOCK_CASE_INSENSITIVE" "$$" &
+  MOCK_HTTP_PID=$!
+  # Out of the jobs, so waiting for the upload workers does not wait for it
+  disown "$MOCK_HTTP_PID"
+  while [[ ! -s "$2" ]] && kill -0 "$MOCK_HTTP_PID" 2>/dev/null; do
+    sleep_ms 10
+  done
+  [[ -s "$2" ]] && MOCK_HTTP_URL="http://127.0.0.1:$(< "$2")/upload"
+}
+
+# Pick the file to send for a name: the compacted copy of a sparse file, the delta of a file
+# already on the host, its compressed copy, or the file itself. The result is stored in SOURCE, its name on the host in REMOTE.
+upload_source() {
+  REMOTE="$1"
+  if [[ -n "${SPARSE_EXTENTS[$1]}" ]]; then
+    SOURCE="$STAGING/$1"
+  elif [[ "${DELTA_GEN[$1]}" == [1-9]* ]]; then
+    SOURCE="$STAGING/$1.delta"
+    delta_name "$1" "${DELTA_GEN[$1]}"
+    REMOTE=$DELTA_NAME
+  elif [[ -n "${COMPRESSED[$1]}" ]]; then
+    SOURCE="$STAGING/$1.zst"
+  else
+    SOURCE="$1"
+  fi
+}
+
+# Send files over a single connection, printing "<exit status> <response code>" per file
+transfer_batch() {
+  local name status args=() target=$UPLOAD_TARGET
+  (( $# > 0 )) || return 0
+  # A mock-http:// folder served by mock_http_server takes the real HTTP path
+  [[ -n "$MOCK_HTTP_URL" ]] && target=$MOCK_HTTP_URL
+  case $target in
+    mock-sftp://*|mock-http://*)
+      local flavor=${UPLOAD_TARGET%%://*}
+      flavor=${flavor#mock-}
+      # This runs in a subshell, take the seed drawn by the caller
+      RANDOM=$TRANSFER_SEED
+      # An SSH handshake costs several round trips, a TCP connection one
+      if [[ -n "$MOCK_CONNECT_MS" ]]; then
+        sleep_ms "$MOCK_CONNECT_MS"
+      else
+        [[ "$flavor" == "sftp" ]] && sleep_ms $(( MOCK_LATENCY_MS * 4 )) || sleep_ms "$MOCK_LATENCY_MS"
+      fi
+      for name in "$@"; do
+        upload_source "$name"
+        mock_upload "$flavor" "${UPLOAD_TARGET#*://}" "$SOURCE" "$REMOTE"
+        status=$?
+        echo "$status $MOCK_CODE"
+      done
+      ;;
+    http://*|https://*)
+      local quoted quoted_source extra=(-H "Expect:")
+      (( HTTP_CHUNKED )) && extra+=(-H "Transfer-Encoding: chunked")
+      for name in "$@"; do
+        # Quote the name for the -F syntax, which splits on ";" and ","
+        upload_source "$name"
+        quoted=${REMOTE//\\/\\\\}
+        quoted=${quoted//\"/\\\"}
+        quoted_source=${SOURCE//\\/\\\\}
+        quoted_source=${quoted_source//\"/\\\"}
+        (( ${#args[@]} > 0 )) && args+=(--next)
+        args+=(-sS --netrc-optional -o /dev/null -w '%{exitcode} %{response_code}\n' "${extra[@]}" "${HTTP_FORM[@]}"
+               -F "$HTTP_FIELD=@\"$quoted_source\";filename=\"$quoted\"" "$target")
+      done
+      # Every --next part is posted over the kept alive connection of the previous one,
+      # curl streams the file into the request body as it reads it
+      curl "${args[@]}"
+      ;;
+    *)
+      for name in "$@"; do
+        upload_source "$name"
+        url_encode "$REMOTE"
+        args+=(-o /dev/null -T "$SOURCE" "$UPLOAD_TARGET/$URL_NAME")
+      done
+      # curl keeps the connection open between the transfers of one invocation
+      curl -sS --netrc-optional --ftp-create-dirs -w '%{exitcode} %{response_code}\n' "${args[@]}"
+      ;;
+  esac
+}
+
+# Classify the result of a transfer with the host $3 as ok, retry, overload or fatal, stored in RESULT.
+# FTP replies are read as FTP defines them, 4yz is transient and 5yz permanent.
+classify_result() {
+  local status="$1" code="$2" host="$3"
+  RESULT=
+  case $host in
+    ftp://*|ftps://*|mock-sftp://*)
+      case $code in
+        421) RESULT=overload ;;                  # Service not available, closing the connection
+        4??) RESULT=retry ;;                     # Transient (no data connection, aborted, busy, no space)
+        [35]??) RESULT=fatal ;;                  # Refused for good (size, name, rights)
+      esac
+      ;;
+    *)
+      case $code in
+        429|503) RESULT=overload ;;              # Host busy or rate limiting
+        408|500|502|504) RESULT=retry ;;         # Transient server side errors
+        [345]??) RESULT=fatal ;;                 # Refused for good (size, name, rights) or redirected
+      esac
+      ;;
+  esac
+  [[ -n "$RESULT" ]] && return
+  case $status in
+    0) RESULT=ok ;;
+    5|6|7|16|18|28|35|52|55|56|92) RESULT=retry ;;  # Broken or timed out connections
+    *) RESULT=fatal ;;
+  esac
+}
+
+# Read the shared breaker state: overloads in a row, open until (ms), cooldown (ms), probing pid
+read_breaker() {
+  read -r OVERLOADS OPEN_UNTIL COOLDOWN PROBE < "$WORK_DIR/breaker"
+}
+
+# Wait while the circuit breaker is open; once the cooldown is over one worker probes the host
+wait_for_breaker() {
+  local announced=0
+  while :; do
+    exec 9>> "$WORK_DIR/breaker.lock"
+    flock 9
+    read_breaker
+    now_ms
+    # A prober that died without a result gives the probe back
+    (( PROBE > 0 )) && ! kill -0 "$PROBE" 2>/dev/null && PROBE=0
+    if (( OPEN_UNTIL == 0 || (NOW_MS >= OPEN_UNTIL && PROBE == 0) )); then
+      (( OPEN_UNTIL > 0 )) && echo "$OVERLOADS $OPEN_UNTIL $COOLDOWN $BASHPID" > "$WORK_DIR/breaker"
+      flock -u 9
+      return
+    fi
+    flock -u 9
+    if (( !announced && NOW_MS < OPEN_UNTIL )); then
+      echo "Host overloaded, pausing uploads for $(( (OPEN_UNTIL - NOW_MS + 999) / 1000 ))s"
+      announced=1
+    fi
+    sleep_ms $(( NOW_MS < OPEN_UNTIL ? OPEN_UNTIL - NOW_MS : 200 ))
+  done
+}
+
+# Feed a transfer result to the circuit breaker
+record_breaker() {
+  exec 9>> "$WORK_DIR/breaker.lock"
+  flock 9
+  read_breaker
+  case $1 in
+    ok)
+      # A successful probe closes the breaker again
+      (( OPEN_UNTIL > 0 )) && COOLDOWN=$BREAKER_COOLDOWN_MS
+      OVERLOADS=0 OPEN_UNTIL=0 PROBE=0
+      ;;
+    overload)
+      (( OVERLOADS++ ))
+      if (( OPEN_UNTIL > 0 || OVERLOADS >= BREAKER_THRESHOLD )); then
+        now_ms
+        OPEN_UNTIL=$(( NOW_MS + COOLDOWN ))
+        COOLDOWN=$(( COOLDOWN * 2 > BREAKER_MAX_COOLDOWN_MS ? BREAKER_MAX_COOLDOWN_MS : COOLDOWN * 2 ))
+        OVERLOADS=0 PROBE=0
+      fi
+      ;;
+    *)
+      # Let another worker probe if ours failed for an unrelated reason
+      (( PROBE == BASHPID )) && PROBE=0
+      ;;
+  esac
+  echo "$OVERLOADS $OPEN_UNTIL $COOLDOWN $PROBE" > "$WORK_DIR/breaker"
+  flock -u 9
+}
+
+# Upload a batch of files, retrying transient failures on a fresh connection with
+# jittered exponential backoff. Files that change while they are read are sent again,
+# files that cannot be sent are listed in WORK_DIR/failed.
+upload_batch() {
+  local pending=("$@") retry reread sent unchanged transfer attempt=0 status code i delay seed name identity size flags
+  local compressed clock compress_ms
+  local -A before=() after=() hashes=() rereads=() COMPRESSED=()
+  # A per batch seed keeps injected failures identical between runs
+  [[ -n "$MOCK_SEED" ]] && RANDOM=$(( MOCK_SEED + BATCH_INDEX ))
+
+  while (( ${#pending[@]} > 0 )); do
+    snapshot_files before "${pending[@]}"
+    # Hash files that are new or changed since the manifest was written, within the same read window
+    local rehash=()
+    for name in "${pending[@]}"; do
+      # Only --hash, or a hash already in the manifest, makes a file worth hashing
+      [[ "$name" == .filinator-* ]] && continue
+      (( HASH )) || [[ "${ENTRY_HASH[$name]:--}" != "-" ]] || continue
+      identity=${before[$name]% *}
+      if [[ "${ENTRY_HASH[$name]:--}" == "-" || "$identity" != "${ENTRY_SIZE[$name]} ${ENTRY_MTIME[$name]}" ]]; then
+        rehash+=("$name")
+      fi
+    done
+    hashes=()
+    (( ${#rehash[@]} > 0 )) && hash_files hashes before "${rehash[@]}"
+    # Sparse files are sent without their holes, the manifest knows where the data goes
+    for name in "${pending[@]}"; do
+      if [[ -n "${SPARSE_EXTENTS[$name]}" ]]; then
+        (( ${rereads[$name]:-0} > 0 )) && data_extents "$name" && SPARSE_EXTENTS[$name]=$EXTENTS
+        compact_sparse "$name" "$STAGING/$name" "${SPARSE_EXTENTS[$name]}"
+      fi
+    done
+    # Files are sent compressed when that pays, at a level following the time it takes
+    if (( COMPRESS )); then
+      now_ms
+      clock=$NOW_MS
+      for name in "${pending[@]}"; do
+        compress_file "$name" "${before[$name]%% *}"
+      done
+      now_ms
+      compress_ms=$(( NOW_MS - clock ))
+    fi
+    # Large files already on the host are sent as the blocks changed since, or not at all
+    unchanged=()
+    if (( DELTA )); then
+      transfer=()
+      for name in "${pending[@]}"; do
+        size=${before[$name]%% *}
+        # Only the manifest can tell restores which deltas to apply
+        if [[ -n "${ENTRY_SIZE[$name]}" && -z "${SPARSE_EXTENTS[$name]}" ]] && (( ${size:-0} >= DELTA_MIN_SIZE )) &&
+           [[ -z "${DELTA_GEN[$name]}" || ${rereads[$name]:-0} -gt 0 ]]; then
+          make_delta "$name"
+        fi
+        [[ "${DELTA_GEN[$name]}" == "same" ]] && unchanged+=("$name") || transfer+=("$name")
+      done
+      pending=("${transfer[@]}")
+    fi
+
+    retry=()
+    sent=()
+    i=0
+    # A batch of unchanged files has nothing to send, and must not hold the probe of the breaker
+    if (( ${#pending[@]} > 0 )); then
+      wait_for_breaker
+      seed=$RANDOM
+      now_ms
+      clock=$NOW_MS
+      while read -r status code; do
+        classify_result "$status" "$code" "$UPLOAD_TARGET"
+        record_breaker "$RESULT"
+        case $RESULT in
+          ok) sent+=("${pending[i]}") ;;
+          fatal) echo "Upload failed: ${pending[i]} (status $status, response $code)"
+                 printf '%s\0' "${pending[i]}" >> "$WORK_DIR/failed" ;;
+          *) retry+=("${pending[i]}") ;;
+        esac
+        (( i++ ))
+      done < <(TRANSFER_SEED=$seed transfer_batch "${pending[@]}")
+      # A connection cut off before any result hands the probe over too
+      (( i > 0 )) || record_breaker retry
+      now_ms
+      (( COMPRESS )) && balance_level "$compress_ms" $(( NOW_MS - clock ))
+    fi
+    # Files without a result were cut off with the connection
+    retry+=("${pending[@]:i}")
+    sent+=("${unchanged[@]}")
+
+    # Send again what changed during the read, record what was really sent
+    snapshot_files after "${sent[@]}"
+    reread=()
+    for name in "${sent[@]}"; do
+      flags=-
+      [[ "${DELTA_GEN[$name]}" == [1-9]* ]] && flags="delta=${DELTA_GEN[$name]}"
+      [[ -n "${COMPRESSED[$name]}" ]] && flags=${COMPRESSED[$name]}
+      compressed=""
+      [[ ",${ENTRY_FLAGS[$name]}," =~ ,(zstd(=[0-9]+)?), ]] && compressed=${BASH_REMATCH[1]}
+      # A file sent whole without --delta no longer matches its signature
+      if (( DELTA )); then
+        save_signature "$name"
+      elif [[ -f "$DELTA_STATE/$name" ]]; then
+        rm -f "$DELTA_STATE/$name"
+      fi
+      if [[ -n "${before[$name]}" && "${before[$name]}" == "${after[$name]}" ]]; then
+        # A twin sent itself has an object of its own again
+        if [[ -n "${hashes[$name]}" || ",${ENTRY_FLAGS[$name]}," == *,same,* || ( -n "${ENTRY_SIZE[$name]}" &&
+              ( "${after[$name]% *}" != "${ENTRY_SIZE[$name]} ${ENTRY_MTIME[$name]}" || "${COMPRESSED[$name]}" != "$compressed" ) ) ]]; then
+          manifest_update "$name" "${after[$name]}" "${SPARSE_EXTENTS[$name]}" "${hashes[$name]}" "$flags"
+        fi
+      elif (( ${rereads[$name]:-0} < REREAD_RETRIES )); then
+        rereads[$name]=$(( ${rereads[$name]:-0} + 1 ))
+        reread+=("$name")
+      else
+        echo "Uploaded $name while it was still changing"
+        [[ "$flags" == "-" ]] && flags=changed || flags="changed,$flags"
+        manifest_update "$name" "${after[$name]}" "${SPARSE_EXTENTS[$name]}" "${hashes[$name]}" "$flags"
+      fi
+    done
+
+    pending=("${retry[@]}" "${reread[@]}")
+    (( ${#retry[@]} > 0 )) || continue
+    if (( ++attempt > RETRIES )); then
+      printf "Upload failed after $RETRIES retries: %s\n" "${retry[@]}"
+      printf '%s\0' "${retry[@]}" >> "$WORK_DIR/failed"
+      pending=("${reread[@]}")
+      continue
+    fi
+    # Full jitter keeps the workers from retrying in lockstep
+    delay=$(( BACKOFF_BASE_MS << (attempt - 1) ))
+    (( delay > BACKOFF_MAX_MS )) && delay=$BACKOFF_MAX_MS
+    sleep_ms $(( delay * RANDOM / 32768 ))
+  done
+
+  for name in "$@"; do
+    [[ -n "${SPARSE_EXTENTS[$name]}" ]] && rm -f "$STAGING/$name"
+    [[ -n "${DELTA_GEN[$name]}" ]] && rm -f "$STAGING/$name.delta" "$STAGING/$name.sums"
+    (( COMPRESS )) && rm -f "$STAGING/$name.zst"
+  done
+}
+
+# List the objects the host needs for the current folder, NUL separated: what this upload sent,
+# every entry of the manifest with the deltas of its current chain, the manifest itself and the
+# dictionaries it names. Twins have no object, their original is listed for them.
+write_generation() {
+  local name root path size mtime extents hash flags gen head start
+  {
+    cat "$WORK_DIR/uploads"
+    if [[ -f "$MANIFEST" ]]; then
+      printf '%s\0' "$MANIFEST" "$MERKLE"
+      while IFS=$'\t' read -r name root path size mtime extents hash flags; do
+        [[ ",$flags," == *,same,* ]] && continue
+        printf -v name '%b' "$name"
+        printf '%s\0' "$name"
+        [[ ",$flags," =~ ,delta=([0-9]+), ]] || continue
+        head=${BASH_REMATCH[1]}
+        # The signature knows where the chain starts, without it every delta up to the head is kept
+        start=1
+        [[ -f "$DELTA_STATE/$name" ]] && read -r _ gen _ start < "$DELTA_STATE/$name"
+        [[ "$gen" == "$head" && -n "$start" ]] || start=1
+        for (( gen = start; gen <= head; gen++ )); do
+          delta_name "$name" "$gen"
+          printf '%s\0' "$DELTA_NAME"
+        done
+      done < <(grep -v '^#' "$MANIFEST")
+      awk -F '\t' -v ORS='\0' '
+        !/^#/ && match("," $8 ",", /,zstd=[0-9]+,/) { used[substr("," $8 ",", RSTART + 6, RLENGTH - 7)] }
+        END { for (id in used) print ".filinator-dict." id }
+      ' "$MANIFEST"
+    fi
+  } | LC_ALL=C sort -zu
+}
+
+# Find the files of the upload holding the same content as another one, shares often keep copies of
+# each other: files of the same size are hashed, through the hash cache, and of each set of equal
+# hashes only the first name is sent. Only plain files of the manifest take part, sparse files and
+# files sent as deltas keep objects of their own. The others, the twins, move from WORK_DIR/uploads
+# to WORK_DIR/twins with their original in TWIN_OF and their hash in TWIN_HASH; TWIN_IDENTITY holds
+# the "size mtime ctime" of twins and originals when they were hashed.
+find_twins() {
+  local name original identity hash first
+  declare -gA TWIN_OF=() TWIN_HASH=() TWIN_IDENTITY=()
+  : > "$WORK_DIR/twins"
+  : > "$WORK_DIR/twins.hashes"
+  [[ -f "$MANIFEST" ]] || return 0
+  # Files sharing their size with another one are the only candidates
+  xargs -0 -r stat --printf '%s\t%n\0' -- < "$WORK_DIR/uploads" 2>/dev/null |
+    awk -F '\t' -v ORS='\0' -v delta="$DELTA" -v largest="$DELTA_MIN_SIZE" '
+      RS == "\n" { if (!/^#/ && $6 == "-") plain[$1]; next }
+      {
+        name = key = substr($0, length($1) + 2)
+        if (name ~ /^\.filinator-/ || (delta && $1 >= largest)) next
+        gsub(/\\/, "\\\\\\\\", key)
+        gsub(/\t/, "\\t", key)
+        gsub(/\n/, "\\n", key)
+        if (key in plain) print $1 "\t" name
+      }
+    ' "$MANIFEST" RS='\0' - | LC_ALL=C sort -z -t $'\t' -k1,1n |
+    awk -v RS='\0' -v ORS='\0' -F '\t' '
+      { name = substr($0, length($1) + 2) }
+      $1 == size { if (first != "") print first; first = ""; print name; next }
+      { size = $1; first = name }
+    ' > "$WORK_DIR/twins.candidates"
+  [[ -s "$WORK_DIR/twins.candidates" ]] || return 0
+  set_phase "finding twins" "$(tr -cd '\0' < "$WORK_DIR/twins.candidates" | wc -c)"
+  run_batches "$HASH_BATCH" twin_batch < "$WORK_DIR/twins.candidates"
+  # The first name of each hash is the original, the others are its twins
+  while IFS= read -r -d '' name && IFS= read -r -d '' identity && IFS= read -r -d '' hash &&
+        IFS= read -r -d '' original && IFS= read -r -d '' first; do
+    TWIN_IDENTITY[$original]=$first
+    TWIN_OF[$name]=$original
+    TWIN_HASH[$name]=$hash
+    TWIN_IDENTITY[$name]=$identity
+    printf '%s\0' "$name" >> "$WORK_DIR/twins"
+  done < <(LC_ALL=C sort -z -t $'\t' -k1,1 -k3 "$WORK_DIR/twins.hashes" |
+           awk -v RS='\0' -v ORS='\0' -F '\t' '
+             { name = substr($0, length($1 $2) + 3) }
+             $1 == hash { print name; print $2; print $1; print original; print identity; next }
+             { hash = $1; original = name; identity = $2 }
+           ')
+  awk -v RS='\0' -v ORS='\0' 'FILENAME == ARGV[1] { twin[$0]; next } !($0 in twin)' \
+    "$WORK_DIR/twins" "$WORK_DIR/uploads" > "$WORK_DIR/uploads.new" && mv "$WORK_DIR/uploads.new" "$WORK_DIR/uploads"
+}
+
+# Hash a batch of twin candidates, appending "hash<TAB>size mtime ctime<TAB>name" records to
+# WORK_DIR/twins.hashes for the files that kept their identity while they were read
+twin_batch() {
+  local name
+  local -A before=() after=() hashes=()
+  snapshot_files before "$@"
+  hash_files hashes before "$@"
+  snapshot_files after "$@"
+  for name in "$@"; do
+    [[ -n "${hashes[$name]}" && -n "${before[$name]}" && "${before[$name]}" == "${after[$name]}" ]] || continue
+    # One short write per record keeps the records of parallel workers whole
+    printf '%s\t%s\t%s\0' "${hashes[$name]}" "${after[$name]}" "$name" >> "$WORK_DIR/twins.hashes"
+  done
+}
+
+# Once the originals are sent, record as "same" entries with their hash the twins whose original went
+# up plain and unchanged since both were hashed, and which did not change either. The other twins
+# are printed NUL separated, to be sent themselves. Counts the recorded ones in TWINS_SETTLED.
+settle_twins() {
+  local name original identity
+  local -A now=() failed=()
+  TWINS_SETTLED=0
+  while IFS= read -r -d '' name; do
+    failed[$name]=1
+  done < "$WORK_DIR/failed"
+  while IFS=$'\t' read -r -d '' identity name; do
+    now[$name]=$identity
+  done < <(printf '%s\0' "${!TWIN_IDENTITY[@]}" | xargs -0 -r stat --printf '%s %.9Y %.9Z\t%n\0' -- 2>/dev/null)
+  while IFS= read -r -d '' name; do
+    original=${TWIN_OF[$name]}
+    if [[ -z "${failed[$original]}" && -n "${now[$original]}" && "${now[$original]}" == "${TWIN_IDENTITY[$original]}" &&
+          -n "${now[$name]}" && "${now[$name]}" == "${TWIN_IDENTITY[$name]}" &&
+          "${ENTRY_FLAGS[$original]}" == "-" && -z "${SPARSE_EXTENTS[$original]}" &&
+          ( "${ENTRY_HASH[$original]}" == "-" || "${ENTRY_HASH[$original]}" == "${TWIN_HASH[$name]}" ) ]]; then
+      # Restores find the original by its hash
+      [[ "${ENTRY_HASH[$original]}" == "-" ]] && manifest_update "$original" "${now[$original]}" "" "${TWIN_HASH[$name]}" ""
+      manifest_update "$name" "${now[$name]}" "" "${TWIN_HASH[$name]}" same
+      # Not sent, it has no chain of deltas of its own any more
+      rm -f "$DELTA_STATE/$name"
+      (( TWINS_SETTLED++ ))
+    else
+      printf '%s\0' "$name"
+    fi
+  done < "$WORK_DIR/twins"
+}
+
+# Upload the NUL separated names read from stdin, BATCH files per connection and JOBS
+# connections in parallel, then the manifest updated with what was sent
+upload_files() {
+  local count failed bytes generation ext id started=$EPOCHREALTIME
+  if [[ "$UPLOAD_TARGET" == mock-*://* ]]; then
+    mkdir -p "${UPLOAD_TARGET#*://}"
+  fi
+  if [[ "$UPLOAD_TARGET" == mock-http://* ]] && (( MOCK_HTTP_SERVER )); then
+    mock_http_server "${UPLOAD_TARGET#*://}" "$WORK_DIR/mock-http.port"
+    if [[ -z "$MOCK_HTTP_URL" ]]; then
+      echo "Could not start the mock HTTP server" >&2
+      exit 1
+    fi
+  fi
+  echo "0 0 $BREAKER_COOLDOWN_MS 0" > "$WORK_DIR/breaker"
+  echo "$COMPRESS_LEVEL" > "$WORK_DIR/level"
+  : > "$WORK_DIR/compressibility"
+  : > "$WORK_DIR/failed"
+  : > "$WORK_DIR/updates"
+  load_manifest all
+  declare -gA DELTA_GEN=()
+  (( ${#SPARSE_EXTENTS[@]} > 0 || DELTA || COMPRESS )) && mkdir -p "$STAGING"
+  (( DELTA )) && mkdir -p "$DELTA_STATE"
+
+  if (( PHYSICAL_ORDER )); then
+    physical_order 1 > "$WORK_DIR/uploads"
+  else
+    cat > "$WORK_DIR/uploads"
+  fi
+  load_hash_cache "$WORK_DIR/uploads"
+  count=$(tr -cd '\0' < "$WORK_DIR/uploads" | wc -c)
+  bytes=$(xargs -0 -r stat -c %s -- < "$WORK_DIR/uploads" | awk '{ bytes += $1 } END { print bytes + 0 }')
+  find_twins
+  if (( COMPRESS )); then
+    set_phase "training dictionaries"
+    load_compressibility
+    train_dicts "$WORK_DIR/uploads"
+    # A dictionary goes once and before the files compressed with it, which are useless without it
+    for ext in "${!DICT_ID[@]}"; do
+      id=${DICT_ID[$ext]}
+      [[ -f "$DICT_STATE/sent.$id" ]] && continue
+      cp "$DICT_STATE/dict.$id" ".filinator-dict.$id"
+      (( count++ ))
+      BATCH_INDEX=0 upload_batch ".filinator-dict.$id"
+      rm -f ".filinator-dict.$id"
+      if grep -qzxF -- ".filinator-dict.$id" "$WORK_DIR/failed"; then
+        unset "DICT_ID[$ext]"
+      else
+        touch "$DICT_STATE/sent.$id"
+      fi
+    done
+  fi
+  set_phase uploading "$(tr -cd '\0' < "$WORK_DIR/uploads" | wc -c)"
+  run_batches "$BATCH" upload_batch < "$WORK_DIR/uploads"
+  # Then the twins, from the manifest as the originals left it
+  if [[ -s "$WORK_DIR/twins" ]]; then
+    apply_updates "$MANIFEST"
+    load_manifest all
+    settle_twins > "$WORK_DIR/twins.send"
+    (( TWINS_SETTLED == 0 )) || echo "$TWINS_SETTLED files are identical to other ones and were not sent again"
+    set_phase "uploading twins" "$(tr -cd '\0' < "$WORK_DIR/twins.send" | wc -c)"
+    run_batches "$BATCH" upload_batch < "$WORK_DIR/twins.send"
+  fi
+  [[ -d "$STAGING" ]] && rmdir "$STAGING"
+  if [[ -s "$WORK_DIR/compressibility" ]]; then
+    awk -F '\t' -v level="$(< "$WORK_DIR/level")" '
+      { read += $2; wrote += $3 } END { printf "Compressed %d bytes into %d, at level %d in the end\n", read, wrote, level }
+    ' "$WORK_DIR/compressibility"
+    save_compressibility
+  fi
+
+  # The manifest goes last, once it describes the files as they were sent
+  if [[ -f "$MANIFEST" ]]; then
+    apply_updates "$MANIFEST"
+    (( count++ ))
+    BATCH_INDEX=0 upload_batch "$MANIFEST"
+    # With its tree, comparing backups only needs the manifest when they differ
+    write_merkle "$MANIFEST" > "$MERKLE"
+    (( count++ ))
+    BATCH_INDEX=0 upload_batch "$MERKLE"
+  fi
+  # Then the generation, telling --gc what the host must keep for this folder
+  [[ -s "$FOLDER_ID" ]] || od -An -tx1 -N8 /dev/urandom | tr -d ' \n' > "$FOLDER_ID"
+  generation=".filinator-generation.$(< "$FOLDER_ID").$(date -u +%Y%m%dT%H%M%SZ)"
+  write_generation > "$generation"
+  (( count++ ))
+  BATCH_INDEX=0 upload_batch "$generation"
+  rm -f "$generation"
+
+  if [[ -n "$MOCK_HTTP_URL" ]]; then
+    kill "$MOCK_HTTP_PID" 2>/dev/null
+  fi
+  failed=$(tr -cd '\0' < "$WORK_DIR/failed" | wc -c)
+  echo "Uploaded $(( count - failed ))/$count files ($bytes bytes) in $(awk -v s="$started" -v e="$EPOCHREALTIME" 'BEGIN { printf "%.2f", e - s }')s"
+  (( failed == 0 )) || exit 1
+}
+
+# Download files from the mock host or with curl into the cache folder $1, under a
+# ".partial." name, printing "<exit status> <response code>" per file
+download_batch() {
+  local cache="$1" name args=()
+  shift
+  case $FETCH_SOURCE in
+    mock-sftp://*|mock-http://*)
+      local flavor=${FETCH_SOURCE%%://*} dir=${FETCH_SOURCE#*://}
+      flavor=${flavor#mock-}
+      RANDOM=$TRANSFER_SEED
+      if [[ -n "$MOCK_CONNECT_MS" ]]; then
+        sleep_ms "$MOCK_CONNECT_MS"
+      else
+        [[ "$flavor" == "sftp" ]] && sleep_ms $(( MOCK_LATENCY_MS * 4 )) || sleep_ms "$MOCK_LATENCY_MS"
+      fi
+      for name in "$@"; do
+        [[ "$flavor" == "sftp" ]] && sleep_ms $(( MOCK_LATENCY_MS * 3 + MOCK_OVERHEAD_MS )) || sleep_ms $(( MOCK_LATENCY_MS + MOCK_OVERHEAD_MS ))
+        if (( MOCK_FAILURE_RATE > 0 && RANDOM % 100 < MOCK_FAILURE_RATE )); then
+          echo "mock-$flavor: injected failure for $name" >&2
+          [[ "$flavor" == "http" ]] && echo "0 503" || echo "55 000"
+        elif [[ ! -f "$dir/$name" ]]; then
+          [[ "$flavor" == "http" ]] && echo "22 404" || echo "78 550"
+        else
+          (( MOCK_BANDWIDTH > 0 )) && sleep_ms $(( $(stat -c %s "$dir/$name") * 1000 / MOCK_BANDWIDTH ))
+          cp "$dir/$name" "$cache/.partial.$name" && echo "0 200" || echo "23 000"
+        fi
+      done
+      ;;
+    *)
+      for name in "$@"; do
+        url_encode "$name"
+        args+=(-o "$cache/.partial.$name" "$FETCH_SOURCE/$URL_NAME")
+      done
+      # One invocation keeps the connection open between the transfers
+      curl -sS --fail --netrc-optional -w '%{exitcode} %{response_code}\n' "${args[@]}"
+      ;;
+  esac
+}
+
+# Fetch a batch of files into the cache folder $1, retrying transient failures with
+# jittered exponential backoff. Cached files take the mtime of their manifest entry,
+# files that cannot be fetched are listed in WORK_DIR/failed.
+fetch_batch() {
+  local cache="$1" pending retry attempt=0 status code i delay seed
+  shift
+  pending=("$@")
+  [[ -n "$MOCK_SEED" ]] && RANDOM=$(( MOCK_SEED + BATCH_INDEX ))
+  while (( ${#pending[@]} > 0 )); do
+    retry=()
+    i=0
+    seed=$RANDOM
+    while read -r status code; do
+      classify_result "$status" "$code" "$FETCH_SOURCE"
+      case $RESULT in
+        ok)
+          mv "$cache/.partial.${pending[i]}" "$cache/${pending[i]}"
+          [[ -n "${ENTRY_MTIME[${pending[i]}]}" ]] && touch -m -d "@${ENTRY_MTIME[${pending[i]}]}" "$cache/${pending[i]}"
+          ;;
+        fatal)
+          echo "Fetch failed: ${pending[i]} (status $status, response $code)"
+          rm -f "$cache/.partial.${pending[i]}"
+          printf '%s\0' "${pending[i]}" >> "$WORK_DIR/failed"
+          ;;
+        *) retry+=("${pending[i]}") ;;
+      esac
+      (( i++ ))
+    done < <(TRANSFER_SEED=$seed download_batch "$cache" "${pending[@]}")
+    pending=("${retry[@]}" "${pending[@]:i}")
+    (( ${#pending[@]} > 0 )) || break
+    if (( ++attempt > RETRIES )); then
+      printf "Fetch failed after $RETRIES retries: %s\n" "${pending[@]}"
+      printf '%s\0' "${pending[@]}" >> "$WORK_DIR/failed"
+      break
+    fi
+    delay=$(( BACKOFF_BASE_MS << (attempt - 1) ))
+    (( delay > BACKOFF_MAX_MS )) && delay=$BACKOFF_MAX_MS
+    sleep_ms $(( delay * RANDOM / 32768 ))
+  done
+}
+
+# Restore the named paths from the host without downloading the rest of the backup.
+# The manifest maps the decoded tree to the names on the host; fetched files stay in a
+# local cache, so asking again for them, or for a folder holding them, reads no network.
+# Without paths, the decoded tree is listed instead.
+fetch_files() {
+  local cache path name filename temp gen original count=0 cached=0 failed=0 started=$EPOCHREALTIME selected=() missing=()
+  local -A target=() identities=() downloads=()
+  url_encode "$FETCH_SOURCE"
+  cache="$CACHE_ROOT/$URL_NAME"
+  mkdir -p "$cache"
+  : > "$WORK_DIR/failed"
+
+  # The manifest is small next to the backup, always take the current one
+  declare -gA ENTRY_MTIME=()
+  fetch_batch "$cache" "$MANIFEST"
+  [[ -s "$WORK_DIR/failed" ]] && exit 1
+  MANIFEST="$cache/$MANIFEST" load_manifest all
+
+  # Match the decoded paths of the entries against the escaped paths asked for
+  for path in "${OPERANDS[@]}"; do
+    path=${path%/}
+    [[ "$path" == /* ]] || path="/$path"
+    manifest_escape "$path"
+    printf '%s\n' "$ESCAPED"
+  done > "$WORK_DIR/fetch.paths"
+  while IFS=$'\t' read -r name filename; do
+    printf -v name '%b' "$name"
+    printf -v filename '%b' "$filename"
+    if (( ${#OPERANDS[@]} == 0 )); then
+      printf '%s\t%s\n' "${ENTRY_SIZE[$name]}" "$filename"
+      continue
+    fi
+    selected+=("$name")
+    target[$name]=${filename#/}
+  done < <(awk -F '\t' -v OFS='\t' '
+    FILENAME == ARGV[1] { wanted[$0] = 1; count++; next }
+    /^#/ { next }
+    {
+      root = $2
+      sub(/\/$/, "", root)
+      path = root "/" $3
+      if (!count) { print $1, path; next }
+      for (dir = path; dir != ""; sub(/\/[^\/]*$/, "", dir))
+        if (dir in wanted) { print $1, path; next }
+    }
+  ' "$WORK_DIR/fetch.paths" "$cache/$MANIFEST")
+  (( ${#OPERANDS[@]} > 0 )) || return 0
+  if (( ${#selected[@]} == 0 )); then
+    echo "Nothing in the backup matches ${OPERANDS[*]}"
+    exit 1
+  fi
+
+  # A cached copy is current when it has the mtime of the manifest entry
+  snapshot_files identities "${selected[@]/#/$cache/}"
+  for name in "${selected[@]}"; do
+    path=${identities[$cache/$name]#* }
+    if [[ -n "$path" && "${path% *}" == "${ENTRY_MTIME[$name]}" ]]; then
+      (( cached++ ))
+    else
+      missing+=("$name")
+    fi
+  done
+  # Twins were sent once, under the name of another file with the same content
+  for name in "${missing[@]}"; do
+    original=${ENTRY_BY_HASH[${ENTRY_HASH[$name]}]}
+    [[ ",${ENTRY_FLAGS[$name]}," == *,same,* && -n "$original" ]] || original=$name
+    [[ "$original" != "$name" && "$(stat -c %.9Y "$cache/$original" 2>/dev/null)" == "${ENTRY_MTIME[$original]}" ]] ||
+      downloads[$original]=1
+  done
+  set_phase fetching "${#downloads[@]}"
+  (( ${#downloads[@]} == 0 )) || printf '%s\0' "${!downloads[@]}" | run_batches "$BATCH" fetch_batch "$cache"
+  for name in "${missing[@]}"; do
+    original=${ENTRY_BY_HASH[${ENTRY_HASH[$name]}]}
+    [[ ",${ENTRY_FLAGS[$name]}," == *,same,* && -n "$original" && -f "$cache/$original" ]] || continue
+    cp --reflink=auto "$cache/$original" "$cache/$name" && touch -m -d "@${ENTRY_MTIME[$name]}" "$cache/$name"
+  done
+  # Files sent with --delta also need their deltas, newest first as each names the one before
+  for name in "${selected[@]}"; do
+    [[ ",${ENTRY_FLAGS[$name]}," =~ ,delta=([0-9]+), ]] || continue
+    gen=${BASH_REMATCH[1]}
+    while (( gen > 0 )); do
+      delta_name "$name" "$gen"
+      [[ -f "$cache/$DELTA_NAME" ]] || fetch_batch "$cache" "$DELTA_NAME"
+      [[ -f "$cache/$DELTA_NAME" ]] || break
+      read -r _ _ gen _ < "$cache/$DELTA_NAME"
+    done
+  done
+  # And the dictionaries of the files sent compressed, which never change once sent
+  for name in "${selected[@]}"; do
+    [[ ",${ENTRY_FLAGS[$name]}," =~ ,zstd=([0-9]+), ]] || continue
+    [[ -f "$cache/.filinator-dict.${BASH_REMATCH[1]}" ]] || fetch_batch "$cache" ".filinator-dict.${BASH_REMATCH[1]}"
+  done
+  DELTA_DIR=$cache
+
+  CONFLICTS_SKIPPED=0 CONFLICTS_KEPT=0 CONFLICTS_RENAMED=0
+  for name in "${selected[@]}"; do
+    [[ -f "$cache/$name" ]] || continue
+    filename=${target[$name]}
+    mkdir -p "$(dirname "$filename")"
+    # Restore a copy, the cached file stays for the next fetch
+    temp="$(dirname "$filename")/.filinator-fetch.$$"
+    if ! cp --reflink=auto "$cache/$name" "$temp"; then
+      (( failed++ ))
+      continue
+    fi
+    restore_file "$temp" "$filename" "$name"
+    case $? in
+      0) (( ++count )) ;;
+      1) (( failed++ )) ;;
+    esac
+    rm -f "$temp"
+  done
+  if (( CONFLICTS_SKIPPED + CONFLICTS_KEPT + CONFLICTS_RENAMED > 0 )); then
+    echo "Existing files: $CONFLICTS_SKIPPED identical skipped, $CONFLICTS_KEPT newer kept, $CONFLICTS_RENAMED renamed aside"
+  fi
+  echo "Restored $count/${#selected[@]} files ($cached from the cache) in $(awk -v s="$started" -v e="$EPOCHREALTIME" 'BEGIN { printf "%.2f", e - s }')s"
+  (( failed > 0 )) && echo "$failed files could not be restored"
+  [[ ! -s "$WORK_DIR/failed" ]] && (( failed == 0 )) || exit 1
+}
+
+# List the objects stored on the host, NUL separated
+list_host() {
+  local rest
+  case $GC_TARGET in
+    mock-sftp://*|mock-http://*|file://*)
+      find "${GC_TARGET#*://}" -maxdepth 1 -type f ! -name '.partial.*' -printf '%f\0'
+      ;;
+    ftp://*|ftps://*|sftp://*|scp://*)
+      # A listing cut short would look like files gone, only a complete one counts
+      curl -sS --netrc-optional --list-only "$GC_TARGET/" > "$WORK_DIR/gc.listing" || return 1
+      tr -d '\r' < "$WORK_DIR/gc.listing" | grep -vx '\.\|\.\.' | tr '\n' '\0'
+      ;;
+    *)
+      echo "Cannot list the files of $GC_TARGET" >&2
+      return 1
+      ;;
+  esac
+}
+
+# Delete a batch of objects from the host, over one connection where the protocol allows.
+# A failed deletion does not stop the others, gc_host lists the host again to find them.
+delete_batch() {
+  local name rest args=()
+  case $GC_TARGET in
+    mock-sftp://*|mock-http://*|file://*)
+      for name in "$@"; do
+        rm -f "${GC_TARGET#*://}/$name"
+      done
+      ;;
+    ftp://*|ftps://*)
+      # Sent after the transfer, in the folder of the target; "*" goes on past a failure
+      for name in "$@"; do
+        args+=(-Q "-*DELE $name")
+      done
+      curl -sS --netrc-optional -o /dev/null "${args[@]}" "$GC_TARGET/"
+      ;;
+    sftp://*)
+      # SFTP quote commands take paths from the root of the server
+      rest=${GC_TARGET#*://}
+      [[ "$rest" == */* ]] && rest="/${rest#*/}" || rest=""
+      for name in "$@"; do
+        name=${name//\\/\\\\}
+        args+=(-Q "*rm \"$rest/${name//\"/\\\"}\"")
+      done
+      curl -sS --netrc-optional -o /dev/null "${args[@]}" "$GC_TARGET/"
+      ;;
+  esac
+}
+
+# Pick the generations to keep from the NUL separated generation names of stdin, newest first.
+# Each folder, named by the id in its generations, keeps the newest of each of its last KEEP_DAILY
+# days, KEEP_WEEKLY weeks and KEEP_MONTHLY months, and always its newest; generations written
+# before they had an id count as one more folder. Prints "keep" or "drop", a tab and the name.
+select_generations() {
+  tr '\0' '\n' | sort -r > "$WORK_DIR/gc.generations"
+  sed -E 's/^.*\.(....)(..)(..)T(..)(..)(..)Z$/\1-\2-\3 \4:\5:\6Z/' "$WORK_DIR/gc.generations" |
+    date -u -f - '+%Y-%m-%d %G-W%V %Y-%m' 2>/dev/null |
+    paste "$WORK_DIR/gc.generations" - |
+    awk -F '\t' -v daily="$KEEP_DAILY" -v weekly="$KEEP_WEEKLY" -v monthly="$KEEP_MONTHLY" '
+      BEGIN { limit[1] = daily; limit[2] = weekly; limit[3] = monthly }
+      {
+        id = substr($1, length(".filinator-generation.") + 1)
+        id = index(id, ".") ? substr(id, 1, index(id, ".") - 1) : ""
+        split($2, period, " ")
+        keep = !(id in newest)
+        newest[id]
+        for (i = 1; i <= 3; i++) {
+          if ((id, i, period[i]) in seen) continue
+          seen[id, i, period[i]]
+          if (count[id, i]++ < limit[i]) keep = 1
+        }
+        print (keep ? "keep" : "drop") "\t" $1
+      }
+    '
+}
+
+# Remove from the host everything no kept generation needs. Every upload stores a generation,
+# the list of the objects of the folder at the time; the kept ones are marked, and the objects
+# missing from all of them are swept. Only objects some generation listed, or named like ours,
+# are swept: the others belong to someone else, unless --sweep-foreign. Lists are sorted on disk,
+# memory stays flat however many.
+gc_host() {
+  local name count foreign failed
+  list_host > "$WORK_DIR/gc.listed" || exit 1
+  LC_ALL=C sort -z "$WORK_DIR/gc.listed" > "$WORK_DIR/gc.objects"
+  grep -zE '^\.filinator-generation\.([0-9a-f]+\.)?[0-9]{8}T[0-9]{6}Z$' "$WORK_DIR/gc.objects" |
+    select_generations > "$WORK_DIR/gc.selection"
+  if [[ ! -s "$WORK_DIR/gc.selection" ]]; then
+    echo "No generation on $GC_TARGET yet, nothing can be collected"
+    return 0
+  fi
+
+  # Read every generation: the kept ones mark what stays, all of them tell what is ours
+  mkdir -p "$WORK_DIR/gc"
+  : > "$WORK_DIR/failed"
+  declare -gA ENTRY_MTIME=()
+  FETCH_SOURCE=$GC_TARGET
+  cut -f 2 "$WORK_DIR/gc.selection" | tr '\n' '\0' > "$WORK_DIR/gc.all"
+  awk -F '\t' -v ORS='\0' '$1 == "keep" { print $2 }' "$WORK_DIR/gc.selection" > "$WORK_DIR/gc.kept"
+  set_phase "reading generations" "$(tr -cd '\0' < "$WORK_DIR/gc.all" | wc -c)"
+  run_batches "$BATCH" fetch_batch "$WORK_DIR/gc" < "$WORK_DIR/gc.all"
+  if [[ -s "$WORK_DIR/failed" ]]; then
+    echo "Collection aborted, some generations could not be read"
+    exit 1
+  fi
+  while IFS= read -r -d '' name; do
+    cat "$WORK_DIR/gc/$name"
+  done < "$WORK_DIR/gc.kept" | cat - "$WORK_DIR/gc.kept" | LC_ALL=C sort -zu > "$WORK_DIR/gc.marked"
+  while IFS= read -r -d '' name; do
+    cat "$WORK_DIR/gc/$name"
+  done < "$WORK_DIR/gc.all" | cat - "$WORK_DIR/gc.all" | LC_ALL=C sort -zu > "$WORK_DIR/gc.known"
+
+  # Sweep what is on the host and marked by no generation
+  LC_ALL=C comm -z -23 "$WORK_DIR/gc.objects" "$WORK_DIR/gc.marked" > "$WORK_DIR/gc.unmarked"
+  if (( SWEEP_FOREIGN )); then
+    cp "$WORK_DIR/gc.unmarked" "$WORK_DIR/gc.garbage"
+  else
+    { LC_ALL=C comm -z -12 "$WORK_DIR/gc.unmarked" "$WORK_DIR/gc.known"
+      grep -zE '^\.filinator-(manifest|merkle|delta\.[0-9]{6}\..+|dict\.[0-9]+)$' "$WORK_DIR/gc.unmarked"
+    } | LC_ALL=C sort -zu > "$WORK_DIR/gc.garbage"
+  fi
+  count=$(tr -cd '\0' < "$WORK_DIR/gc.garbage" | wc -c)
+  foreign=$(( $(tr -cd '\0' < "$WORK_DIR/gc.unmarked" | wc -c) - count ))
+  echo "Keeping $(tr -cd '\0' < "$WORK_DIR/gc.kept" | wc -c) of $(wc -l < "$WORK_DIR/gc.selection") generations, $count unreachable files"
+  (( foreign == 0 )) || echo "Left alone $foreign files no generation lists, --sweep-foreign removes them too"
+  if (( DRY_RUN )); then
+    tr '\0' '\n' < "$WORK_DIR/gc.garbage"
+    return 0
+  fi
+  set_phase deleting "$count"
+  run_batches "$BATCH" delete_batch < "$WORK_DIR/gc.garbage"
+
+  # Not every protocol tells which deletion failed, what is still listed did
+  if ! list_host > "$WORK_DIR/gc.listed"; then
+    echo "Removed up to $count files from $GC_TARGET, which could not be listed again to check"
+    exit 1
+  fi
+  LC_ALL=C sort -z "$WORK_DIR/gc.listed" | LC_ALL=C comm -z -12 "$WORK_DIR/gc.garbage" - > "$WORK_DIR/gc.failed"
+  failed=$(tr -cd '\0' < "$WORK_DIR/gc.failed" | wc -c)
+  echo "Removed $(( count - failed )) files from $GC_TARGET"
+  if (( failed > 0 )); then
+    echo "Could not remove $failed files:"
+    tr '\0' '\n' < "$WORK_DIR/gc.failed"
+    exit 1
+  fi
+}
+
+# Download byte ranges of objects into WORK_DIR/scrub/ranges as INDEX.OFFSET, one
+# "index<TAB>offset<TAB>length<TAB>name" item each, over a single connection, the index being
+# the number of the object in the scrub. Ranges that cannot be read list their object in WORK_DIR/failed.
+scrub_ranges() {
+  local item index offset length name status i=0 items=() args=()
+  for item in "$@"; do
+    IFS=$'\t' read -r index offset length name <<< "$item"
+    items+=("$name")
+    printf -v offset '%015d' "$offset"
+    case $SCRUB_TARGET in
+      mock-sftp://*|mock-http://*)
+        sleep_ms $(( MOCK_LATENCY_MS + MOCK_OVERHEAD_MS ))
+        (( MOCK_BANDWIDTH > 0 )) && sleep_ms $(( length * 1000 / MOCK_BANDWIDTH ))
+        dd if="${SCRUB_TARGET#*://}/$name" of="$WORK_DIR/scrub/ranges/$index.$offset" bs=1M iflag=skip_bytes,count_bytes \
+          skip=$(( 10#$offset )) count="$length" status=none 2>/dev/null || printf '%s\0' "$name" >> "$WORK_DIR/failed"
+        ;;
+      *)
+        url_encode "$name"
+        # A range applies to a whole invocation, each one goes in its own --next part
+        (( ${#args[@]} > 0 )) && args+=(--next)
+        args+=(-sS --fail --netrc-optional -w '%{exitcode}\n' -r "$(( 10#$offset ))-$(( 10#$offset + length - 1 ))"
+               -o "$WORK_DIR/scrub/ranges/$index.$offset" "$SCRUB_TARGET/$URL_NAME")
+        ;;
+    esac
+  done
+  (( ${#args[@]} > 0 )) || return 0
+  while read -r status; do
+    (( status == 0 )) || printf '%s\0' "${items[i]}" >> "$WORK_DIR/failed"
+    (( i++ ))
+  done < <(curl "${args[@]}")
+}
+
+# Check that the host still holds intact copies, within SCRUB_BUDGET bytes per run. Half of the
+# budget follows a cursor kept in SCRUB_STATE, so every file is checked once per cycle; the rest is
+# a random sample weighted by size. Objects are read in ranges, JOBS at a time, and their sha256
+# compared with the manifest, after putting back the holes of sparse files and the deltas.
+scrub_host() {
+  local cursor=0 cycle=1 started=$EPOCHREALTIME index object name hash extents flags size total taken used
+  local checked=0 bytes=0 bad=0 offset head
+  local -A unreadable=()
+  if [[ ! -f "$MANIFEST" ]]; then
+    echo "No $MANIFEST in the current folder, there is nothing to check against"
+    exit 1
+  fi
+  load_manifest all
+  [[ -f "$SCRUB_STATE" ]] && read -r cursor cycle < "$SCRUB_STATE"
+
+  # Files with a hash, numbered in manifest order, with the size of their object on the host.
+  # Twins have none, the object of their original is checked for them. Tree hashes and deltas
+  # need perl.
+  awk -F '\t' -v OFS='\t' -v perl="$HAVE_PERL" '
+    /^#/ || $7 == "-" || ("," $8 ",") ~ /,same,/ { next }
+    !perl && ($7 ~ /^sha256-tree:/ || ("," $8 ",") ~ /,delta=/) { next }
+    {
+      object = $4
+      if ($6 != "-") {
+        object = 0
+        count = split($6, extent, ",")
+        for (i = 1; i <= count; i++) if (extent[i] != "none") object += substr(extent[i], index(extent[i], "+") + 1)
+      }
+      print ++n, object, $1, $7, $6, $8, $4
+    }
+  ' "$MANIFEST" > "$WORK_DIR/scrub.entries"
+  total=$(wc -l < "$WORK_DIR/scrub.entries")
+  if (( total == 0 )); then
+    echo "No file has a hash in $MANIFEST, upload with --hash first"
+    exit 1
+  fi
+  (( cursor < total )) || cursor=0
+
+  # The cursor takes the next files of the cycle, always at least one
+  awk -F '\t' -v cursor="$cursor" -v budget=$(( SCRUB_BUDGET / 2 )) -v state="$WORK_DIR/scrub.cursor" '
+    { line[NR] = $0; size[NR] = $2 }
+    END {
+      for (k = 0; k < NR; k++) {
+        i = (cursor + k) % NR + 1
+        if (k > 0 && used + size[i] > budget) break
+        used += size[i]
+        print line[i]
+      }
+      print k, used > state
+    }
+  ' "$WORK_DIR/scrub.entries" > "$WORK_DIR/scrub.selected"
+  read -r taken used < "$WORK_DIR/scrub.cursor"
+  # Then a sample without replacement weighted by size: the largest log(u) / size come first
+  awk -F '\t' -v OFS='\t' -v seed="$RANDOM" '
+    BEGIN { srand(seed) }
+    FILENAME == ARGV[1] { taken[$1]; next }
+    !($1 in taken) { print log(rand()) / ($2 + 1), $0 }
+  ' "$WORK_DIR/scrub.selected" "$WORK_DIR/scrub.entries" 2>/dev/null | sort -t $'\t' -g -r -k 1,1 |
+    awk -F '\t' -v OFS='\t' -v budget=$(( SCRUB_BUDGET - used )) '
+      used + $3 <= budget { used += $3; sub(/^[^\t]*\t/, ""); print }
+    ' >> "$WORK_DIR/scrub.selected"
+
+  # Read the objects in ranges, whole for the first upload of a file sent with --delta or compressed,
+  # and for empty ones, which have no range to ask for but must still be on the host
+  mkdir -p "$WORK_DIR/scrub/ranges"
+  : > "$WORK_DIR/failed"
+  : > "$WORK_DIR/scrub.ranges"
+  : > "$WORK_DIR/scrub.whole"
+  while IFS=$'\t' read -r index object name hash extents flags size; do
+    printf -v name '%b' "$name"
+    if [[ ",$flags," =~ ,(delta=|zstd[=,]) ]] || (( object == 0 )); then
+      printf '%s\0' "$name" >> "$WORK_DIR/scrub.whole"
+      continue
+    fi
+    for (( offset = 0; offset < object; offset += SCRUB_RANGE )); do
+      printf '%s\t%s\t%s\t%s\0' "$index" "$offset" $(( object - offset < SCRUB_RANGE ? object - offset : SCRUB_RANGE )) "$name"
+    done >> "$WORK_DIR/scrub.ranges"
+  done < "$WORK_DIR/scrub.selected"
+  set_phase "checking ranges" "$(tr -cd '\0' < "$WORK_DIR/scrub.ranges" | wc -c)"
+  run_batches "$BATCH" scrub_ranges < "$WORK_DIR/scrub.ranges"
+  FETCH_SOURCE=$SCRUB_TARGET
+  DELTA_DIR="$WORK_DIR/scrub"
+  set_phase "checking files" "$(tr -cd '\0' < "$WORK_DIR/scrub.whole" | wc -c)"
+  run_batches "$BATCH" fetch_batch "$WORK_DIR/scrub" < "$WORK_DIR/scrub.whole"
+  while IFS= read -r -d '' name; do
+    unreadable[$name]=1
+  done < "$WORK_DIR/failed"
+
+  # Compare what the host holds with the manifest
+  while IFS=$'\t' read -r index object name hash extents flags size; do
+    printf -v name '%b' "$name"
+    (( checked++, bytes += object ))
+    object="$WORK_DIR/scrub/$name"
+    if [[ -z "${unreadable[$name]}" && ",$flags," == *,delta=* ]]; then
+      # The first upload and every delta after it make the file
+      [[ ",$flags," =~ ,delta=([0-9]+), ]]
+      head=${BASH_REMATCH[1]}
+      offset=$head
+      while (( offset > 0 )); do
+        delta_name "$name" "$offset"
+        [[ -f "$WORK_DIR/scrub/$DELTA_NAME" ]] || fetch_batch "$WORK_DIR/scrub" "$DELTA_NAME"
+        [[ -f "$WORK_DIR/scrub/$DELTA_NAME" ]] || break
+        read -r _ _ offset _ < "$WORK_DIR/scrub/$DELTA_NAME"
+      done
+      [[ -f "$object" ]] && apply_deltas "$object" "$name" "$head" "$WORK_DIR/scrub" >/dev/null || unreadable[$name]=1
+      rm -f "$WORK_DIR/scrub/.filinator-delta."*
+    elif [[ -z "${unreadable[$name]}" && ",$flags," =~ ,zstd(=([0-9]+))?, ]]; then
+      # A damaged compressed file fails the check as it is
+      if [[ -n "${BASH_REMATCH[2]}" && ! -f "$WORK_DIR/scrub/.filinator-dict.${BASH_REMATCH[2]}" ]]; then
+        fetch_batch "$WORK_DIR/scrub" ".filinator-dict.${BASH_REMATCH[2]}"
+      fi
+      if [[ -f "$object" ]]; then
+        decompress_file "$object" "$name" "$WORK_DIR/scrub" > /dev/null
+      else
+        unreadable[$name]=1
+      fi
+    elif [[ -z "${unreadable[$name]}" ]]; then
+      # Empty objects were fetched whole
+      [[ -f "$object" ]] || cat "$WORK_DIR/scrub/ranges/$index".* > "$object" 2>/dev/null
+      rm -f "$WORK_DIR/scrub/ranges/$index".*
+      if [[ "$extents" != "-" ]]; then
+        expand_sparse "$object" "$object.expanded" "$size" "$extents" && mv "$object.expanded" "$object"
+      fi
+    fi
+    if [[ -n "${unreadable[$name]}" ]]; then
+      echo "Unreadable on the host: $name"
+      (( bad++ ))
+    elif [[ "$(stat -c %s "$object")" != "$size" ]] || ! check_hash "$object" "$hash"; then
+      echo "Corrupt on the host: $name"
+      (( bad++ ))
+    fi
+    rm -f "$object"
+  done < "$WORK_DIR/scrub.selected"
+
+  # Move the cursor past the files it took, a new cycle starts after the last one
+  (( cursor += taken ))
+  if (( cursor >= total )); then
+    (( cursor -= total, cycle++ ))
+  fi
+  echo "$cursor $cycle" > "$SCRUB_STATE"
+  echo "Checked $checked files ($bytes bytes) in $(awk -v s="$started" -v e="$EPOCHREALTIME" 'BEGIN { printf "%.2f", e - s }')s, $bad bad," \
+    "cycle $cycle at $(( cursor * 100 / total ))%"
+  (( bad == 0 )) || exit 1
+}
+
+# Queue a job for the daemon: the arguments of a run in the current folder, which is its share.
+# Each job gets a folder in SPOOL_DIR/jobs with its arguments, share, weight, state and log.
+submit_job() {
+  local id dir wake lock sequence=0
+  mkdir -p "$SPOOL_DIR/jobs" || exit 1
+  # Ids start with a number taken in turn, so the jobs sort in the order they were submitted
+  exec {lock}>> "$SPOOL_DIR/sequence.lock"
+  flock "$lock"
+  [[ -f "$SPOOL_DIR/sequence" ]] && read -r sequence < "$SPOOL_DIR/sequence"
+  echo $(( ++sequence )) > "$SPOOL_DIR/sequence"
+  exec {lock}>&-
+  printf -v id '%06d-%(%Y%m%dT%H%M%S)T' "$sequence" -1
+  # Written aside, the daemon only ever sees complete jobs
+  dir="$SPOOL_DIR/$id.new"
+  mkdir -p "$dir" || exit 1
+  printf '%s\0' "$@" > "$dir/args"
+  printf '%s\n' "$PWD" > "$dir/share"
+  echo "$WEIGHT" > "$dir/weight"
+  echo "queued" > "$dir/state"
+  mv "$dir" "$SPOOL_DIR/jobs/$id" || exit 1
+  # Wake the daemon up, opening the FIFO read-write never blocks when no daemon runs
+  if [[ -p "$SPOOL_DIR/wake" ]]; then
+    exec {wake}<> "$SPOOL_DIR/wake"
+    echo >&"$wake"
+    exec {wake}>&-
+  fi
+  echo "$id"
+}
+
+# Run a queued job in its share with a lower CPU and I/O priority, recording its state as
+# "running PID START" and then "done STATUS START END", times in milliseconds
+run_job() {
+  local dir="$1" args=() start status
+  # The daemon lock and FIFO stay with the daemon
+  exec {lock}>&- {wake}<&-
+  now_ms
+  start=$NOW_MS
+  echo "running $BASHPID $start" > "$dir/state.new" && mv "$dir/state.new" "$dir/state"
+  mapfile -d '' args < "$dir/args"
+  (cd "$(< "$dir/share")" && FILINATOR_JOB=${dir##*/} exec "${JOB_PRIORITY[@]}" bash "$SCRIPT_PATH" "${args[@]}") > "$dir/log" 2>&1 < /dev/null
+  status=$?
+  now_ms
+  echo "done $status $start $NOW_MS" > "$dir/state.new" && mv "$dir/state.new" "$dir/state"
+}
+
+# Run the queued jobs, SLOTS at a time and one at a time per share so jobs of the same folder
+# never collide. Free slots go to the share with the least weighted run time: each finished job
+# adds its run time divided by the weight of its share (start-time fair queueing), and a share
+# coming back after being idle starts at the lowest time of the others.
+run_daemon() {
+  local lock wake dir id share weight state pid start status end stop=0 least
+  local -A running=() busy=() used=() queued=()
+  mkdir -p "$SPOOL_DIR/jobs" || exit 1
+  exec {lock}> "$SPOOL_DIR/daemon.lock"
+  if ! flock -n "$lock"; then
+    echo "A daemon already runs on $SPOOL_DIR"
+    exit 1
+  fi
+  [[ -p "$SPOOL_DIR/wake" ]] || mkfifo "$SPOOL_DIR/wake"
+  exec {wake}<> "$SPOOL_DIR/wake"
+  JOB_PRIORITY=(nice -n 10)
+  command -v ionice > /dev/null && JOB_PRIORITY+=(ionice -c 2 -n 7)
+  # Jobs cut short by a previous daemon run again from the start
+  for dir in "$SPOOL_DIR"/jobs/*/; do
+    [[ -f "$dir/state" ]] && read -r state _ < "$dir/state" && [[ "$state" == "running" ]] && echo "queued" > "$dir/state"
+  done
+  trap 'stop=1' TERM INT
+  echo "Running jobs from $SPOOL_DIR, $SLOTS at a time"
+
+  while (( !stop || ${#running[@]} > 0 )); do
+    # Charge the finished jobs to their share
+    for pid in "${!running[@]}"; do
+      kill -0 "$pid" 2>/dev/null && continue
+      wait "$pid"
+      dir=${running[$pid]}
+      share=$(< "$dir/share")
+      read -r state status start end < "$dir/state"
+      read -r weight < "$dir/weight"
+      used[$share]=$(( ${used[$share]:-0} + (end - start) / weight ))
+      echo "Finished ${dir##*/} with status $status"
+      unset "running[$pid]" "busy[$share]"
+    done
+
+    # Start jobs while there are free slots, oldest first within a share
+    queued=()
+    if (( !stop )); then
+      for dir in "$SPOOL_DIR"/jobs/*/; do
+        dir=${dir%/}
+        read -r state _ < "$dir/state" 2>/dev/null && [[ "$state" == "queued" ]] || continue
+        share=$(< "$dir/share")
+        [[ -n "${busy[$share]}" || -n "${queued[$share]}" ]] || queued[$share]=$dir
+      done
+    fi
+    while (( ${#running[@]} < SLOTS && ${#queued[@]} > 0 )); do
+      least=""
+      for share in "${!used[@]}"; do
+        [[ -z "$least" || ${used[$share]} -lt $least ]] && [[ -n "${busy[$share]}${queued[$share]}" ]] && least=${used[$share]}
+      done
+      for share in "${!queued[@]}"; do
+        [[ -n "${used[$share]}" ]] || used[$share]=${least:-0}
+      done
+      share=""
+      for id in "${!queued[@]}"; do
+        [[ -z "$share" || ${used[$id]} -lt ${used[$share]} ]] && share=$id
+      done
+      dir=${queued[$share]}
+      unset "queued[$share]"
+      # Marked before it starts, the next look at the queue must not find it again
+      echo "running" > "$dir/state"
+      run_job "$dir" &
+      running[$!]=$dir
+      busy[$share]=1
+      echo "Started ${dir##*/} in $share"
+    done
+
+    # Sleep until a job is submitted, checking now and then for finished ones
+    read -r -t 1 -u "$wake"
+  done
+}
+
+# List the jobs of the daemon with their state, share and arguments
+list_jobs() {
+  local dir state status start end args=()
+  now_ms
+  for dir in "$SPOOL_DIR"/jobs/*/; do
+    dir=${dir%/}
+    [[ -f "$dir/state" ]] || continue
+    read -r state status start end < "$dir/state"
+    case $state in
+      running) state="running for $(( (NOW_MS - start) / 1000 ))s" ;;
+      done) state="exited with $status after $(( (end - start) / 1000 ))s" ;;
+    esac
+    mapfile -d '' args < "$dir/args"
+    printf '%s\t%s\t%s\t%s\n' "${dir##*/}" "$state" "$(< "$dir/share")" "${args[*]}"
+  done
+}
+
+# Format a number of milliseconds like 1h02m, 5m12s or 12s, stored in DURATION
+format_duration() {
+  local seconds=$(( $1 / 1000 ))
+  if (( seconds >= 3600 )); then
+    printf -v DURATION '%dh%02dm' $(( seconds / 3600 )) $(( seconds % 3600 / 60 ))
+  elif (( seconds >= 60 )); then
+    printf -v DURATION '%dm%02ds' $(( seconds / 60 )) $(( seconds % 60 ))
+  else
+    DURATION="${seconds}s"
+  fi
+}
+
+# Show what the runs of this user are doing from the statistics they publish, all of them or
+# the one with the given PID or daemon job. Only reads files, the runs are not disturbed.
+show_status() {
+  local file worker tries line found=0 progress batch since count first
+  local -A stat=()
+  now_ms
+  for file in "$STATS_DIR"/*; do
+    [[ -f "$file" && "$file" != *.worker.* ]] || continue
+    # A copy taken while the run rewrites it misses the closing line
+    for (( tries = 0; tries < 10; tries++ )); do
+      mapfile -t STATS_LINES 2>/dev/null < "$file"
+      [[ "${STATS_LINES[*]: -1}" == "end" ]] && break
+      sleep 0.01
+    done
+    (( tries < 10 )) || continue
+    stat=()
+    for line in "${STATS_LINES[@]}"; do
+      stat[${line%% *}]=${line#* }
+    done
+    [[ -z "$1" || "$1" == "${stat[pid]}" || "$1" == "${stat[job]}" ]] || continue
+    # Left behind by a run that was killed
+    if ! kill -0 "${stat[pid]}" 2>/dev/null; then
+      rm -f "$file" "$file".worker.*
+      continue
+    fi
+    found=1
+    line=""
+    [[ "${stat[job]}" == "-" ]] || line=" (job ${stat[job]})"
+    printf '%s%s in %b: %b\n' "${stat[pid]}" "$line" "${stat[folder]}" "${stat[command]}"
+    format_duration $(( NOW_MS - stat[started] ))
+    line="running for $DURATION, ${stat[phase]}"
+    format_duration $(( NOW_MS - stat[phase_started] ))
+    line+=" for $DURATION"
+    if (( stat[total] > 0 )); then
+      line+=": ${stat[done]}/${stat[total]} ($(( 100 * stat[done] / stat[total] ))%)"
+    elif (( stat[done] > 0 )); then
+      line+=": ${stat[done]} done"
+    fi
+    format_duration $(( NOW_MS - stat[updated] ))
+    (( NOW_MS - stat[updated] < 2 * STATS_INTERVAL_MS )) || line+=", no progress for $DURATION"
+    echo "  $line"
+    for worker in "$file".worker.*; do
+      read -r batch since count first 2>/dev/null < "$worker" || continue
+      format_duration $(( NOW_MS - since ))
+      printf '  worker %s: batch %s of %s items from %b, for %s\n' "${worker##*.}" "$batch" "$count" "$first" "$DURATION"
+    done
+  done
+  if (( !found )); then
+    echo "Nothing is running${1:+ as $1}"
+    exit 1
+  fi
+}
+
+# Parse the options following the operation, leaving the other arguments in OPERANDS
+parse_options() {
+  OPERANDS=()
+  while [[ $# -gt 0 ]]; do
+    case $1 in
+      --upload|--fetch|--scrub|--scrub-budget|--strip-root|--gc|--keep-daily|--keep-weekly|--keep-monthly|--slots|--jobs|--batch|--retries|--http-field|--http-form|--on-conflict|--reread-retries|--to-stream|--volume-size|--from-stream)
+        if [[ $# -lt 2 ]]; then
+          echo "Missing value for $1. $USAGE"
+          exit 1
+        fi
+        case $1 in
+          --upload) UPLOAD_TARGET="${2%/}" ;;
+          --fetch) FETCH_SOURCE="${2%/}" ;;
+          --scrub) SCRUB_TARGET="${2%/}" ;;
+          --scrub-budget) SCRUB_BUDGET=$(numfmt --from=iec "$2" 2>/dev/null) || SCRUB_BUDGET="$2" ;;
+          --gc) GC_TARGET="${2%/}" ;;
+          --strip-root) STRIP_ROOT=$(readlink -m "$2") ;;
+          --keep-daily) KEEP_DAILY="$2" ;;
+          --keep-weekly) KEEP_WEEKLY="$2" ;;
+          --keep-monthly) KEEP_MONTHLY="$2" ;;
+          --slots) SLOTS="$2" ;;
+          --jobs) JOBS="$2" ;;
+          --batch) BATCH="$2" ;;
+          --retries) RETRIES="$2" ;;
+          --http-field) HTTP_FIELD="$2" ;;
+          --http-form) HTTP_FORM+=(--form-string "$2") ;;
+          --on-conflict) ON_CONFLICT="$2" ;;
+          --reread-retries) REREAD_RETRIES="$2" ;;
+          --to-stream) STREAM="$2" ;;
+          --volume-size) VOLUME_SIZE=$(numfmt --from=iec "$2" 2>/dev/null) || VOLUME_SIZE="$2" ;;
+          --from-stream) FROM_STREAM="$2" ;;
+        esac
+        shift 2
+        ;;
+      --http-chunked)
+        HTTP_CHUNKED=1
+        shift
+        ;;
+      --compare-content)
+        COMPARE_CONTENT=1
+        shift
+        ;;
+      --hash)
+        HASH=1
+        shift
+        ;;
+      --delta)
+        DELTA=1
+        shift
+        ;;
+      --compress)
+        COMPRESS=1
+        shift
+        ;;
+      --dry-run)
+        DRY_RUN=1
+        shift
+        ;;
+      --sweep-foreign)
+        SWEEP_FOREIGN=1
+        shift
+        ;;
+      --keep-underscores)
+        KEEP_UNDERSCORES=1
+        shift
+        ;;
+      --stream-index)
+        STREAM_INDEX=1
+        shift
+        ;;
+      --physical-order)
+        PHYSICAL_ORDER=1
+        shift
+        ;;
+      --incremental)
+        INCREMENTAL=1
+        shift
+        ;;
+      --)
+        shift
+        OPERANDS+=("$@")
+        break
+        ;;
+      -*)
+        echo "Invalid argument. $USAGE"
+        exit 1
+        ;;
+      *)
+        OPERANDS+=("$1")
+        shift
+        ;;
+    esac
+  done
+  if [[ ! "$JOBS$SLOTS" =~ ^[1-9][0-9]*$ || ! "$BATCH" =~ ^[1-9][0-9]*$ ||
+        ! "$RETRIES$REREAD_RETRIES$KEEP_DAILY$KEEP_WEEKLY$KEEP_MONTHLY$SCRUB_BUDGET" =~ ^[0-9]+$ ]]; then
+    echo "Invalid number for --jobs, --slots, --batch, --retries, --reread-retries, --keep-* or --scrub-budget. $USAGE"
+    exit 1
+  fi
+  if (( COMPRESS )) && ! { command -v zstd > /dev/null && (( HAVE_PERL )); }; then
+    echo "--compress needs zstd and perl"
+    exit 1
+  fi
+  if (( !HAVE_PERL && (PHYSICAL_ORDER || DELTA || MOCK_HTTP_SERVER) )); then
+    echo "--physical-order, --delta and FILINATOR_MOCK_HTTP_SERVER need perl"
+    exit 1
+  fi
+  if (( INCREMENTAL )) && [[ -z "$STREAM" ]]; then
+    echo "--incremental needs a --to-stream destination. $USAGE"
+    exit 1
+  fi
+  if [[ ! "$VOLUME_SIZE" =~ ^[0-9]+$ || ( "$VOLUME_SIZE" != 0 && ( -z "$STREAM" || "$STREAM" == "-" ) ) ]]; then
+    echo "--volume-size needs a size and a --to-stream file. $USAGE"
+    exit 1
+  fi
+  case $ON_CONFLICT in
+    overwrite|skip-identical|keep-newer|rename|fail) ;;
+    *)
+      echo "Invalid conflict policy: $ON_CONFLICT. $USAGE"
+      exit 1
+      ;;
+  esac
 }
 
 # Main function
 main() {
-  case $1 in
+  local mode="$1" command="$*" status
+  # --upload, --fetch, --scrub and --gc are both an operation and an option, keep them for the option parser
+  case $mode in
+    --upload|--fetch|--scrub|--gc) ;;
+    --submit)
+      # The job keeps its own options, only its weight is ours
+      shift
+      if [[ "$1" == "--weight" ]]; then
+        WEIGHT="$2"
+        shift 2
+      fi
+      if [[ ! "$WEIGHT" =~ ^[1-9][0-9]*$ || $# -lt 1 ]]; then
+        echo "Invalid weight or missing operation. $USAGE"
+        exit 1
+      fi
+      submit_job "$@"
+      return
+      ;;
+    *) shift ;;
+  esac
+  parse_options "$@"
+  case $mode in
+    --status|--queue|--daemon|--list) ;;
+    *) start_stats "$command" ;;
+  esac
+  case $mode in
     --encode)
-      # Encode operation: encode folders, encode files, and remove empty folders
-      encode_folders
+      # Encode operation: plan all roots (the current folder by default), encode
+      # files into the current folder, removing the folders they leave empty
+      resolve_roots "${OPERANDS[@]:-.}"
+      if [[ -n "$STREAM" ]]; then
+        if [[ -n "$UPLOAD_TARGET" ]]; then
+          echo "--to-stream cannot be combined with --upload. $USAGE"
+          exit 1
+        fi
+        # Messages go to the standard error while the archive uses the standard output
+        [[ "$STREAM" == "-" ]] && exec {STREAM_FD}>&1 1>&2
+        set_phase planning
+        plan_encode
+        set_phase streaming
+        stream_encode && save_walks
+        return
+      fi
+      set_phase planning
+      plan_encode
+      hash_plan
       encode_files
-      find_empty_folders
+      set_phase "writing the manifest"
+      write_manifest
+      if [[ -n "$UPLOAD_TARGET" ]]; then
+        upload_files < <(awk -v RS='\0' -v ORS='\0' 'NR % 2 == 0' "$WORK_DIR/plan")
+      fi
       ;;
     --decode)
-      # Decode operation: decode files, decode folders, and remove empty folders
+      # Decode operation: decode files, removing the folders they leave empty, and decode folders
+      if [[ -n "$FROM_STREAM" ]]; then
+        stream_decode
+        return
+      fi
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
       decode_files
+      status=$?
       decode_folders
-      find_empty_folders
+      return $status
+      ;;
+    --list)
+      # List operation: print the files of streams, one volume at a time
+      if [[ ${#OPERANDS[@]} -eq 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      list_streams "${OPERANDS[@]}"
+      ;;
+    --fetch)
+      # Fetch operation: restore some paths from the host, or list what it holds
+      fetch_files
+      ;;
+    --import-legacy)
+      # Import operation: build the manifest of a folder encoded by the former script
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      import_legacy
+      ;;
+    --scrub)
+      # Scrub operation: read back part of the backup from the host and check it
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      scrub_host
+      ;;
+    --gc)
+      # Garbage collection: remove from the host what no kept generation needs
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      gc_host
+      ;;
+    --daemon)
+      # Daemon operation: run the submitted jobs until stopped
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      run_daemon
+      ;;
+    --queue)
+      # Queue operation: show the jobs of the daemon
+      list_jobs
+      ;;
+    --status)
+      # Status operation: show what running runs are doing
+      if [[ ${#OPERANDS[@]} -gt 1 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      show_status "${OPERANDS[0]}"
+      ;;
+    --compare)
+      # Compare operation: tell what differs between this backup and another one
+      if [[ ${#OPERANDS[@]} -ne 1 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      if (( !HAVE_PERL )); then
+        echo "--compare needs perl"
+        exit 1
+      fi
+      compare_backups "${OPERANDS[0]}"
+      ;;
+    --upload)
+      # Upload operation: send the already encoded files of the current folder
+      if [[ ${#OPERANDS[@]} -ne 0 ]]; then
+        echo "Invalid number of arguments. $USAGE"
+        exit 1
+      fi
+      upload_files < <(find . -maxdepth 1 -type f ! -samefile "$SCRIPT_PATH" ! -name '.filinator-*' -printf '%f\0')
       ;;
     *)
-      echo "Invalid argument. Usage: $0 [--encode|--decode]"
+      echo "Invalid argument. $USAGE"
       exit 1
       ;;
   esac
 }
 
 # Check the number of command-line arguments
-if [[ $# -ne 1 ]]; then
-  echo "Invalid number of arguments. Usage: $0 [--encode|--decode]"
+if [[ $# -lt 1 ]]; then
+  echo "Invalid number of arguments. $USAGE"
   exit 1
 fi
 
-# Call the main function with the provided argument
-main "$1"
+# Call the main function with the provided arguments
+main "$@"